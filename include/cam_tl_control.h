@@ -5,10 +5,24 @@
 #include <zephyr/types.h>
 
 typedef struct {
+	// Called from interrupt context when the external trigger input has started a capture
+	void (*ext_trigger_cb)(void);
 } cam_tl_control_config_t;
 
-int cam_tl_control_init(void);
+int cam_tl_control_init(const cam_tl_control_config_t *config);
 
-void cam_tl_control_take_picture(void);
+// Starts a capture without blocking. Returns -EBUSY if a capture is already in progress.
+int cam_tl_control_take_picture(void);
 
-#endif
\ No newline at end of file
+bool cam_tl_control_is_busy(void);
+
+// Time from starting a capture until the shutter line is activated
+int cam_tl_control_shutter_lead_ms(void);
+
+// Enables or disables the external trigger input. Returns -ENOTSUP if the input is not configured.
+int cam_tl_control_ext_trigger_arm(bool arm);
+
+// Releases the inputs that draw current while idle, used during downtime
+int cam_tl_control_set_low_power(bool enable);
+
+#endif
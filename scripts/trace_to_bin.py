@@ -0,0 +1,38 @@
+#!/usr/bin/env python3
+"""Convert a trace dump from the td NUS command to a binary trace for CONFIG_CAM_TL_TRACE_REPLAY_FILE.
+
+Only lines consisting of "tr" followed by exactly one record in hex are used, so other
+console output in the log is ignored rather than corrupting the trace.
+"""
+import argparse
+import re
+import sys
+
+# Size of trace_record_t in src/trace_rec.h
+RECORD_SIZE = 34
+TRACE_LINE = re.compile(r'tr([0-9a-f]{%d})' % (2 * RECORD_SIZE))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument('dump', help='console or NUS log holding the tr lines')
+    parser.add_argument('output', help='binary trace file to write')
+    args = parser.parse_args()
+
+    records = []
+    with open(args.dump, errors='replace') as f:
+        for line in f:
+            match = TRACE_LINE.fullmatch(line.strip())
+            if match:
+                records.append(bytes.fromhex(match.group(1)))
+
+    if not records:
+        sys.exit('No trace records found in %s' % args.dump)
+
+    with open(args.output, 'wb') as f:
+        f.write(b''.join(records))
+    print('Wrote %d records to %s' % (len(records), args.output))
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,221 @@
+#include "ble_bench.h"
+#include "nus_tx.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <zephyr/bluetooth/gatt.h>
+#include <bluetooth/services/nus.h>
+
+#define BENCH_THREAD_STACK_SIZE 2048
+#define BENCH_THREAD_PRIORITY   7
+#define BENCH_TX_TIMEOUT_MS     2000
+#define BENCH_PING_TIMEOUT_MS   1000
+
+enum bench_mode {
+	BENCH_MODE_STREAM,
+	BENCH_MODE_PING,
+};
+
+static struct {
+	enum bench_mode mode;
+	uint32_t count;
+	struct bt_conn *conn;
+} m_job;
+
+static atomic_t m_running = ATOMIC_INIT(0);
+
+K_SEM_DEFINE(bench_start_sem, 0, 1);
+K_SEM_DEFINE(bench_echo_sem, 0, 1);
+static nus_tx_stream_t m_stream_tx;
+
+static volatile uint32_t m_ping_seq_expected;
+static uint32_t m_ping_rtt_us[CONFIG_CAM_TL_BLE_BENCH_MAX_PINGS];
+
+static uint8_t m_stream_buf[CONFIG_BT_L2CAP_TX_MTU];
+static char m_response_msg[128];
+
+static void bench_send_str(struct bt_conn *conn, const char *str)
+{
+	printk("%s\n", str);
+	bt_nus_send(conn, str, strlen(str));
+}
+
+static int bench_start(enum bench_mode mode, struct bt_conn *conn, uint32_t count)
+{
+	if(conn == NULL) {
+		return -ENOTCONN;
+	}
+	if(!atomic_cas(&m_running, 0, 1)) {
+		return -EBUSY;
+	}
+	m_job.mode = mode;
+	m_job.count = count;
+	m_job.conn = bt_conn_ref(conn);
+	k_sem_give(&bench_start_sem);
+	return 0;
+}
+
+int ble_bench_stream_start(struct bt_conn *conn, uint32_t num_bytes)
+{
+	if(num_bytes == 0 || num_bytes > BLE_BENCH_MAX_STREAM_BYTES) {
+		return -EINVAL;
+	}
+	return bench_start(BENCH_MODE_STREAM, conn, num_bytes);
+}
+
+int ble_bench_ping_start(struct bt_conn *conn, uint32_t count)
+{
+	if(count == 0) {
+		return -EINVAL;
+	}
+	if(count > CONFIG_CAM_TL_BLE_BENCH_MAX_PINGS) {
+		count = CONFIG_CAM_TL_BLE_BENCH_MAX_PINGS;
+	}
+	return bench_start(BENCH_MODE_PING, conn, count);
+}
+
+void ble_bench_on_ping_echo(uint32_t seq)
+{
+	if(atomic_get(&m_running) && seq == m_ping_seq_expected) {
+		k_sem_give(&bench_echo_sem);
+	}
+}
+
+int ble_bench_report_link(struct bt_conn *conn)
+{
+	struct bt_conn_info info = {0};
+	char msg[64];
+	int err;
+
+	if(conn == NULL) {
+		return -ENOTCONN;
+	}
+
+	err = bt_conn_get_info(conn, &info);
+	if (err) {
+		return err;
+	}
+
+	// Connection interval is given in units of 1.25 ms
+	sprintf(msg, "Conn int: %u.%02u ms, latency %u, timeout %u ms", (info.le.interval * 125) / 100,
+			(info.le.interval * 125) % 100, info.le.latency, info.le.timeout * 10);
+	bench_send_str(conn, msg);
+	sprintf(msg, "PHY: tx %u, rx %u", info.le.phy->tx_phy, info.le.phy->rx_phy);
+	bench_send_str(conn, msg);
+	sprintf(msg, "Data len: tx %u B/%u us, rx %u B/%u us", info.le.data_len->tx_max_len,
+			info.le.data_len->tx_max_time, info.le.data_len->rx_max_len, info.le.data_len->rx_max_time);
+	bench_send_str(conn, msg);
+	sprintf(msg, "ATT MTU: %u", bt_gatt_get_mtu(conn));
+	bench_send_str(conn, msg);
+	return 0;
+}
+
+static void bench_run_stream(struct bt_conn *conn, uint32_t num_bytes)
+{
+	uint32_t chunk_len = MIN(bt_nus_get_mtu(conn), sizeof(m_stream_buf));
+	uint32_t bytes_sent = 0;
+	int err = 0;
+
+	for(int i = 0; i < sizeof(m_stream_buf); i++) m_stream_buf[i] = '0' + (i % 10);
+
+	int64_t start_ms = k_uptime_get();
+	while(bytes_sent < num_bytes) {
+		uint32_t len = MIN(chunk_len, num_bytes - bytes_sent);
+
+		err = nus_tx_send(&m_stream_tx, conn, m_stream_buf, len, K_MSEC(BENCH_TX_TIMEOUT_MS));
+		if (err) {
+			break;
+		}
+		bytes_sent += len;
+	}
+
+	// Wait until every notification of the stream has been handed to the controller
+	int flush_err = nus_tx_flush(&m_stream_tx, K_MSEC(BENCH_TX_TIMEOUT_MS));
+	if(err == 0) err = flush_err;
+	int64_t elapsed_ms = k_uptime_get() - start_ms;
+
+	if (err) {
+		sprintf(m_response_msg, "Stream aborted after %u bytes (err %i)", bytes_sent, err);
+		bench_send_str(conn, m_response_msg);
+		return;
+	}
+	if(elapsed_ms == 0) elapsed_ms = 1;
+	sprintf(m_response_msg, "Stream: %u bytes in %u ms, %u B/s", bytes_sent, (uint32_t)elapsed_ms,
+			(uint32_t)(((uint64_t)bytes_sent * 1000) / elapsed_ms));
+	bench_send_str(conn, m_response_msg);
+}
+
+static int compare_u32(const void *a, const void *b)
+{
+	uint32_t va = *(const uint32_t *)a;
+	uint32_t vb = *(const uint32_t *)b;
+
+	return (va > vb) - (va < vb);
+}
+
+// Nearest-rank percentile, the smallest sample with at least pct percent of the samples at or below it
+static uint32_t percentile(const uint32_t *sorted, uint32_t n, uint32_t pct)
+{
+	uint32_t rank = DIV_ROUND_UP(n * pct, 100);
+
+	return sorted[CLAMP(rank, 1, n) - 1];
+}
+
+static void bench_run_ping(struct bt_conn *conn, uint32_t count)
+{
+	uint32_t received = 0;
+	char ping_msg[24];
+
+	for(uint32_t seq = 0; seq < count; seq++) {
+		k_sem_reset(&bench_echo_sem);
+		m_ping_seq_expected = seq;
+		sprintf(ping_msg, "pi%04u %u", seq, k_uptime_get_32());
+
+		uint32_t start_cyc = k_cycle_get_32();
+		if(bt_nus_send(conn, ping_msg, strlen(ping_msg)) != 0) {
+			continue;
+		}
+		if(k_sem_take(&bench_echo_sem, K_MSEC(BENCH_PING_TIMEOUT_MS)) == 0) {
+			m_ping_rtt_us[received++] = k_cyc_to_us_floor32(k_cycle_get_32() - start_cyc);
+		}
+	}
+
+	if(received == 0) {
+		sprintf(m_response_msg, "Ping: no echoes received out of %u", count);
+		bench_send_str(conn, m_response_msg);
+		return;
+	}
+
+	qsort(m_ping_rtt_us, received, sizeof(m_ping_rtt_us[0]), compare_u32);
+	sprintf(m_response_msg, "Ping: %u/%u echoed, RTT min %u us", received, count, m_ping_rtt_us[0]);
+	bench_send_str(conn, m_response_msg);
+	sprintf(m_response_msg, "RTT p50 %u us, p90 %u us, p99 %u us, max %u us", percentile(m_ping_rtt_us, received, 50),
+			percentile(m_ping_rtt_us, received, 90), percentile(m_ping_rtt_us, received, 99),
+			m_ping_rtt_us[received - 1]);
+	bench_send_str(conn, m_response_msg);
+}
+
+static void bench_thread(void)
+{
+	nus_tx_stream_init(&m_stream_tx);
+
+	for (;;) {
+		k_sem_take(&bench_start_sem, K_FOREVER);
+
+		ble_bench_report_link(m_job.conn);
+		if(m_job.mode == BENCH_MODE_STREAM) {
+			bench_run_stream(m_job.conn, m_job.count);
+		} else {
+			bench_run_ping(m_job.conn, m_job.count);
+		}
+
+		bt_conn_unref(m_job.conn);
+		m_job.conn = NULL;
+		atomic_clear(&m_running);
+	}
+}
+
+K_THREAD_DEFINE(ble_bench_thread_id, BENCH_THREAD_STACK_SIZE, bench_thread, NULL, NULL, NULL,
+		BENCH_THREAD_PRIORITY, 0, 0);
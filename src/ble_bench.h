@@ -0,0 +1,21 @@
+#ifndef __BLE_BENCH_H
+#define __BLE_BENCH_H
+
+#include <zephyr/kernel.h>
+#include <zephyr/bluetooth/conn.h>
+
+#define BLE_BENCH_MAX_STREAM_BYTES 999999
+
+// Streams num_bytes of filler data over NUS at the maximum rate, then reports the throughput
+int ble_bench_stream_start(struct bt_conn *conn, uint32_t num_bytes);
+
+// Sends count timestamped pings, each of which the peer echoes back with the "po" command
+int ble_bench_ping_start(struct bt_conn *conn, uint32_t count);
+
+// Called when the peer echoes a ping back
+void ble_bench_on_ping_echo(uint32_t seq);
+
+// Reports the negotiated PHY, data length, MTU and connection interval
+int ble_bench_report_link(struct bt_conn *conn);
+
+#endif
@@ -1,6 +1,6 @@
 #include "cam_tl_control.h"
-#include "nrf.h"
 #include <zephyr/drivers/gpio.h>
+#include <zephyr/sys/atomic.h>
 
 #define TIME_FOCUS_MS 700
 #define TIME_SHUTTER_MS 100
@@ -11,10 +11,138 @@ struct gpio_dt_spec pin_shutter = GPIO_DT_SPEC_GET(DT_NODELABEL(pin_shutter), gp
 struct gpio_dt_spec pin_ground = GPIO_DT_SPEC_GET(DT_NODELABEL(pin_ground), gpios);
 #endif
 
-int cam_tl_control_init()
+enum cam_pulse_state {
+	CAM_PULSE_IDLE,
+	CAM_PULSE_FOCUS,
+	CAM_PULSE_SHUTTER,
+};
+
+static cam_tl_control_config_t m_config;
+
+// Set while a focus/shutter pulse is in progress. Any capture request arriving while
+// this is set is rejected, so scheduled and external captures never overlap.
+static atomic_t m_pulse_busy = ATOMIC_INIT(0);
+static volatile enum cam_pulse_state m_pulse_state = CAM_PULSE_IDLE;
+// When true the focus line is held active between pictures, and the shutter can be fired directly
+static volatile bool m_focus_held = false;
+
+static void pulse_timer_handler(struct k_timer *timer);
+K_TIMER_DEFINE(pulse_timer, pulse_timer_handler, NULL);
+
+#if defined(CONFIG_CAM_TL_EXT_TRIGGER)
+static void ext_trigger_fire_latched(void);
+#endif
+
+static void pulse_timer_handler(struct k_timer *timer)
+{
+	switch(m_pulse_state) {
+		case CAM_PULSE_FOCUS:
+			gpio_pin_set_dt(&pin_shutter, 0);
+			m_pulse_state = CAM_PULSE_SHUTTER;
+			k_timer_start(&pulse_timer, K_MSEC(TIME_SHUTTER_MS), K_NO_WAIT);
+			break;
+		case CAM_PULSE_SHUTTER:
+			gpio_pin_set_dt(&pin_shutter, 1);
+			if(!m_focus_held) gpio_pin_set_dt(&pin_focus, 1);
+			m_pulse_state = CAM_PULSE_IDLE;
+			atomic_clear(&m_pulse_busy);
+#if defined(CONFIG_CAM_TL_EXT_TRIGGER)
+			// A trigger that arrived during this pulse is taken now instead of being lost
+			ext_trigger_fire_latched();
+#endif
+			break;
+		default:
+			break;
+	}
+}
+
+// Starts the focus/shutter sequence without blocking. Safe to call from ISR context.
+static int pulse_start(void)
+{
+	if(!atomic_cas(&m_pulse_busy, 0, 1)) {
+		return -EBUSY;
+	}
+
+	if(m_focus_held) {
+		// Camera is already focused, fire the shutter straight away
+		gpio_pin_set_dt(&pin_shutter, 0);
+		m_pulse_state = CAM_PULSE_SHUTTER;
+		k_timer_start(&pulse_timer, K_MSEC(TIME_SHUTTER_MS), K_NO_WAIT);
+	} else {
+		gpio_pin_set_dt(&pin_focus, 0);
+		m_pulse_state = CAM_PULSE_FOCUS;
+		k_timer_start(&pulse_timer, K_MSEC(TIME_FOCUS_MS), K_NO_WAIT);
+	}
+	return 0;
+}
+
+#if defined(CONFIG_CAM_TL_EXT_TRIGGER)
+struct gpio_dt_spec pin_ext_trigger = GPIO_DT_SPEC_GET(DT_NODELABEL(ext_trigger), gpios);
+static struct gpio_callback ext_trigger_cb_data;
+// Time of the last capture started by the trigger, the holdoff only runs from a capture that was taken
+static int64_t m_ext_trigger_last_ms = -CONFIG_CAM_TL_EXT_TRIGGER_HOLDOFF_MS;
+static volatile bool m_ext_trigger_armed = false;
+// Set when a trigger arrives while another capture is in progress, it is fired when the pulse engine goes idle
+static atomic_t m_ext_trigger_latched = ATOMIC_INIT(0);
+
+static void ext_trigger_fire(void)
+{
+	if(pulse_start() == 0) {
+		m_ext_trigger_last_ms = k_uptime_get();
+		if(m_config.ext_trigger_cb) m_config.ext_trigger_cb();
+		return;
+	}
+
+	atomic_set(&m_ext_trigger_latched, 1);
+	// The pulse may have ended between the failed start and setting the latch
+	if(!cam_tl_control_is_busy()) ext_trigger_fire_latched();
+}
+
+static void ext_trigger_fire_latched(void)
+{
+	if(atomic_cas(&m_ext_trigger_latched, 1, 0) && m_ext_trigger_armed) {
+		ext_trigger_fire();
+	}
+}
+
+static void ext_trigger_handler(const struct device *dev, struct gpio_callback *cb, uint32_t pins)
+{
+	int64_t now = k_uptime_get();
+
+	// The nRF GPIOTE has no hardware filter, so reject glitches by checking that the
+	// input is still active, and bounces by enforcing the re-trigger holdoff
+	if(gpio_pin_get_dt(&pin_ext_trigger) != 1) return;
+	if((now - m_ext_trigger_last_ms) < CONFIG_CAM_TL_EXT_TRIGGER_HOLDOFF_MS) return;
+
+	ext_trigger_fire();
+}
+
+static int ext_trigger_init(void)
+{
+	int ret;
+
+	if(!device_is_ready(pin_ext_trigger.port)) {
+		return -ENXIO;
+	}
+
+	ret = gpio_pin_configure_dt(&pin_ext_trigger, GPIO_INPUT);
+	if (ret) {
+		return ret;
+	}
+
+	gpio_init_callback(&ext_trigger_cb_data, ext_trigger_handler, BIT(pin_ext_trigger.pin));
+	return gpio_add_callback(pin_ext_trigger.port, &ext_trigger_cb_data);
+}
+#endif
+
+int cam_tl_control_init(const cam_tl_control_config_t *config)
 {
 	int ret;
 
+	if(config) {
+		m_config = *config;
+	}
+
 	if(!device_is_ready(pin_focus.port)) {
 		return -ENXIO;
 	}
@@ -44,15 +172,82 @@ int cam_tl_control_init()
 	gpio_pin_set_dt(&pin_ground, 0);
 #endif
 
+#if defined(CONFIG_CAM_TL_EXT_TRIGGER)
+	ret = ext_trigger_init();
+	if (ret) {
+		return ret;
+	}
+	ret = cam_tl_control_ext_trigger_arm(true);
+	if (ret) {
+		return ret;
+	}
+#endif
+
 	return 0;
 }
 
-void cam_tl_control_take_picture(void)
+int cam_tl_control_take_picture(void)
 {
-	gpio_pin_set_dt(&pin_focus, 0);
-	k_msleep(TIME_FOCUS_MS);
-	gpio_pin_set_dt(&pin_shutter, 0);
-	k_msleep(TIME_SHUTTER_MS);
-	gpio_pin_set_dt(&pin_focus, 1);
-	gpio_pin_set_dt(&pin_shutter, 1);
-}
\ No newline at end of file
+	return pulse_start();
+}
+
+bool cam_tl_control_is_busy(void)
+{
+	return atomic_get(&m_pulse_busy) != 0;
+}
+
+int cam_tl_control_shutter_lead_ms(void)
+{
+	return m_focus_held ? 0 : TIME_FOCUS_MS;
+}
+
+int cam_tl_control_ext_trigger_arm(bool arm)
+{
+#if defined(CONFIG_CAM_TL_EXT_TRIGGER)
+	int ret;
+
+	if(arm == m_ext_trigger_armed) return 0;
+
+	ret = gpio_pin_interrupt_configure_dt(&pin_ext_trigger,
+					      arm ? GPIO_INT_EDGE_TO_ACTIVE : GPIO_INT_DISABLE);
+	if (ret) {
+		return ret;
+	}
+	m_ext_trigger_armed = arm;
+	if(!arm) atomic_clear(&m_ext_trigger_latched);
+
+	if(IS_ENABLED(CONFIG_CAM_TL_EXT_TRIGGER_PREFOCUS)) {
+		// Hold focus while armed so a trigger only needs to fire the shutter.
+		// Leave the line alone if a pulse is running, the pulse engine restores it when done.
+		m_focus_held = arm;
+		if(!cam_tl_control_is_busy()) gpio_pin_set_dt(&pin_focus, arm ? 0 : 1);
+	}
+	return 0;
+#else
+	return -ENOTSUP;
+#endif
+}
+
+int cam_tl_control_set_low_power(bool enable)
+{
+#if defined(CONFIG_CAM_TL_EXT_TRIGGER) && !defined(CONFIG_CAM_TL_DOWNTIME_KEEP_EXT_TRIGGER)
+	int ret;
+
+	if(enable) {
+		ret = cam_tl_control_ext_trigger_arm(false);
+		if (ret) {
+			return ret;
+		}
+		// Disconnect the input so the pull resistor does not draw current through a closed contact
+		return gpio_pin_configure_dt(&pin_ext_trigger, GPIO_DISCONNECTED);
+	}
+
+	ret = gpio_pin_configure_dt(&pin_ext_trigger, GPIO_INPUT);
+	if (ret) {
+		return ret;
+	}
+	return cam_tl_control_ext_trigger_arm(true);
+#else
+	return 0;
+#endif
+}
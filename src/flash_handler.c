@@ -82,3 +82,23 @@ int flash_handler_write(app_settings_t *settings)
 
     return 0;
 }
+
+int flash_handler_write_block(uint16_t id, const void *data, size_t len)
+{
+	ssize_t written_size = nvs_write(&nvs_fs, id, data, len);
+	if (written_size < 0) {
+		return written_size;
+	}
+
+	return 0;
+}
+
+ssize_t flash_handler_read_block(uint16_t id, void *data, size_t len)
+{
+	return nvs_read(&nvs_fs, id, data, len);
+}
+
+int flash_handler_delete_block(uint16_t id)
+{
+	return nvs_delete(&nvs_fs, id);
+}
@@ -14,4 +14,11 @@ int flash_handler_write(app_settings_t *settings);
 
 int flash_handler_erase(void);
 
+// Raw storage for other modules, ids must not collide with the settings id
+int flash_handler_write_block(uint16_t id, const void *data, size_t len);
+
+ssize_t flash_handler_read_block(uint16_t id, void *data, size_t len);
+
+int flash_handler_delete_block(uint16_t id);
+
 #endif
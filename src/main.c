@@ -33,6 +33,23 @@
 #include "cam_tl_control.h"
 #include "app_settings.h"
 #include "flash_handler.h"
+#include "nus_tx.h"
+#if defined(CONFIG_CAM_TL_BLE_BENCH)
+#include "ble_bench.h"
+#endif
+#if defined(CONFIG_CAM_TL_SYNC)
+#include "sync_capture.h"
+#endif
+#if defined(CONFIG_CAM_TL_DOWNTIME_PM)
+#include "power_state.h"
+#endif
+#include "trace_rec.h"
+#if defined(CONFIG_CAM_TL_TRACE_REPLAY)
+#include "trace_replay.h"
+#if defined(CONFIG_ARCH_POSIX)
+#include <posix_board_if.h>
+#endif
+#endif
 
 #define DEVICE_NAME             CONFIG_BT_DEVICE_NAME
 #define DEVICE_NAME_LEN         (sizeof(DEVICE_NAME) - 1)
@@ -49,6 +66,12 @@
 
 #define UART_BUF_SIZE CONFIG_BT_NUS_UART_BUFFER_SIZE
 
+#if defined(CONFIG_CAM_TL_TRACE)
+#define APP_TRACE(type, data, len) trace_rec_record(type, data, len)
+#else
+#define APP_TRACE(type, data, len) ARG_UNUSED(data)
+#endif
+
 // Until the kit is configured through the app, run at a constant interval (since accurate time is not set)
 static bool m_time_set_from_app = false;
 static app_settings_t app_settings = {.picture_interval_s = 10*60,
@@ -63,6 +86,10 @@ static bool m_settings_changed = false;
 
 static int m_pics_taken_since_reset = 0;
 static int m_pics_taken_since_last_ble_command = 0;
+static atomic_t m_ext_triggers_pending = ATOMIC_INIT(0);
+static int m_ext_triggers_since_reset = 0;
+static atomic_t m_sync_captures_pending = ATOMIC_INIT(0);
+static int m_sync_captures_since_reset = 0;
 
 static struct bt_gatt_exchange_params exchange_params;
 
@@ -77,6 +104,64 @@ static const struct bt_data sd[] = {
 
 struct bt_conn *m_conn = 0;
 
+// All wall clock changes go through here, so they are recorded in the trace
+static void app_set_time(time_t t, trace_clock_src_t source)
+{
+	struct timespec ts = {.tv_sec = t, .tv_nsec = 0};
+	uint8_t trace_data[5];
+
+	sys_put_le32((uint32_t)t, trace_data);
+	trace_data[4] = source;
+	APP_TRACE(TRACE_EVT_CLOCK_SET, trace_data, sizeof(trace_data));
+
+	clock_settime(CLOCK_REALTIME, &ts);
+}
+
+#if defined(CONFIG_CAM_TL_TRACE) || defined(CONFIG_CAM_TL_TRACE_REPLAY)
+#define PACKED_SETTINGS_LEN 9
+
+// Packs the schedule settings for the trace: the intervals as little endian uint16,
+// start and end hour and minute, and a weekday bitmask with Sunday as bit 0
+static uint8_t settings_pack(uint8_t *buf)
+{
+	sys_put_le16(app_settings.picture_interval_s, &buf[0]);
+	sys_put_le16(app_settings.downtime_pic_int_s, &buf[2]);
+	buf[4] = app_settings.pic_cap_start_hour;
+	buf[5] = app_settings.pic_cap_start_min;
+	buf[6] = app_settings.pic_cap_end_hour;
+	buf[7] = app_settings.pic_cap_end_min;
+	buf[8] = 0;
+	for(int i = 0; i < 7; i++) {
+		if(app_settings.wday_on_map[i]) buf[8] |= BIT(i);
+	}
+	return PACKED_SETTINGS_LEN;
+}
+#endif
+
+#if defined(CONFIG_CAM_TL_TRACE)
+static void app_trace_settings(trace_evt_t type)
+{
+	uint8_t buf[PACKED_SETTINGS_LEN];
+
+	trace_rec_record(type, buf, settings_pack(buf));
+}
+#endif
+
+#if defined(CONFIG_CAM_TL_DOWNTIME_PM)
+static k_tid_t m_main_thread;
+#endif
+static volatile bool m_wake_requested = false;
+
+// Keeps the unit out of downtime for a while, and wakes the main loop if it is sleeping in downtime.
+// Outside downtime the loop sleeps are left alone, since they pace the scheduler.
+static void app_wake(void)
+{
+	m_wake_requested = true;
+#if defined(CONFIG_CAM_TL_DOWNTIME_PM)
+	if(m_main_thread && power_state_is_downtime()) k_wakeup(m_main_thread);
+#endif
+}
+
 static void app_bt_start_advertising(bool enable) 
 {
 	int err;
@@ -92,6 +177,32 @@ static void app_bt_start_advertising(bool enable)
 	}
 }
 
+#if defined(CONFIG_CAM_TL_DOWNTIME_PM)
+// Downtime advertising interval is given in units of 0.625 ms
+#define DOWNTIME_ADV_INTERVAL ((CONFIG_CAM_TL_DOWNTIME_ADV_INTERVAL_MS * 8) / 5)
+
+static bool m_adv_slow = false;
+
+// Switches between normal and rare "wake me" advertising. This is only done while disconnected,
+// since the stack resumes advertising with the last used parameters after a disconnect.
+static void app_bt_set_slow_advertising(bool slow)
+{
+	int err;
+
+	if(slow == m_adv_slow || m_conn) return;
+
+	bt_le_adv_stop();
+	err = bt_le_adv_start(slow ? BT_LE_ADV_PARAM(BT_LE_ADV_OPT_CONNECTABLE, DOWNTIME_ADV_INTERVAL,
+												 DOWNTIME_ADV_INTERVAL, NULL) : BT_LE_ADV_CONN,
+						  ad, ARRAY_SIZE(ad), sd, ARRAY_SIZE(sd));
+	if (err) {
+		printk("Advertising failed to restart (err %d)\n", err);
+		return;
+	}
+	m_adv_slow = slow;
+}
+#endif
+
 static void exchange_func(struct bt_conn *conn, uint8_t att_err,
 			  struct bt_gatt_exchange_params *params)
 {
@@ -105,7 +216,31 @@ static void exchange_func(struct bt_conn *conn, uint8_t att_err,
 		printk("Failed to get connection info %d\n", err);
 		return;
 	}
+
+	printk("Negotiated MTU %u, connection interval %u.%02u ms\n", bt_gatt_get_mtu(conn),
+		   (info.le.interval * 125) / 100, (info.le.interval * 125) % 100);
+}
+
+static void le_param_updated(struct bt_conn *conn, uint16_t interval,
+			     uint16_t latency, uint16_t timeout)
+{
+	printk("Connection parameters updated: interval %u.%02u ms, latency %u, timeout %u ms\n",
+		   (interval * 125) / 100, (interval * 125) % 100, latency, timeout * 10);
+}
+
+#if defined(CONFIG_BT_USER_PHY_UPDATE)
+static void le_phy_updated(struct bt_conn *conn, struct bt_conn_le_phy_info *param)
+{
+	printk("PHY updated: tx %u, rx %u\n", param->tx_phy, param->rx_phy);
 }
+#endif
+
+#if defined(CONFIG_BT_USER_DATA_LEN_UPDATE)
+static void le_data_len_updated(struct bt_conn *conn, struct bt_conn_le_data_len_info *info)
+{
+	printk("Data length updated: tx %u, rx %u\n", info->tx_max_len, info->rx_max_len);
+}
+#endif
 
 
 static void connected(struct bt_conn *conn, uint8_t err)
@@ -118,6 +253,7 @@ static void connected(struct bt_conn *conn, uint8_t err)
 	printk("Connected\n");
 
 	dk_set_led_on(CON_STATUS_LED);
+	app_wake();
 
 	exchange_params.func = exchange_func;
 
@@ -138,6 +274,9 @@ static void disconnected(struct bt_conn *conn, uint8_t reason)
 	dk_set_led_off(CON_STATUS_LED);
 
 	m_nus_notifications_enabled = false;
+	m_conn = 0;
+	// Give the phone a chance to reconnect before going back to downtime
+	app_wake();
 }
 
 #ifdef CONFIG_BT_LBS_SECURITY_ENABLED
@@ -160,6 +299,13 @@ static void security_changed(struct bt_conn *conn, bt_security_t level,
 static struct bt_conn_cb conn_callbacks = {
 	.connected        = connected,
 	.disconnected     = disconnected,
+	.le_param_updated = le_param_updated,
+#if defined(CONFIG_BT_USER_PHY_UPDATE)
+	.le_phy_updated   = le_phy_updated,
+#endif
+#if defined(CONFIG_BT_USER_DATA_LEN_UPDATE)
+	.le_data_len_updated = le_data_len_updated,
+#endif
 #ifdef CONFIG_BT_LBS_SECURITY_ENABLED
 	.security_changed = security_changed,
 #endif
@@ -192,14 +338,22 @@ static struct bt_conn_auth_cb conn_auth_callbacks = {
 static struct bt_conn_auth_cb conn_auth_callbacks;
 #endif
 
-static volatile bool take_picture_override = false;
 static volatile bool ble_enabled = true;
+static volatile bool take_picture_requested = false;
 static void button_changed(uint32_t button_state, uint32_t has_changed)
 {
+#if defined(CONFIG_CAM_TL_TRACE)
+	uint8_t trace_data[8];
+
+	sys_put_le32(button_state, &trace_data[0]);
+	sys_put_le32(has_changed, &trace_data[4]);
+	trace_rec_record(TRACE_EVT_BUTTON, trace_data, sizeof(trace_data));
+#endif
 	if (has_changed & USER_BUTTON) {
 		uint32_t user_button_state = button_state & USER_BUTTON;
 
-		if(user_button_state) take_picture_override = true;
+		if(user_button_state) take_picture_requested = true;
+		app_wake();
 	}
 	if ((has_changed & BLE_ENABLE_BUTTON) && (button_state & BLE_ENABLE_BUTTON)) {
 		ble_enabled = !ble_enabled;
@@ -247,7 +401,49 @@ static int send_nus_response_str(char *response)
 }
 
 static volatile bool time_update_requested = false;
-static volatile bool take_picture_requested = false;
+
+#if defined(CONFIG_CAM_TL_TRACE)
+#define TRACE_DUMP_STACK_SIZE   2048
+#define TRACE_DUMP_PRIORITY     7
+#define TRACE_DUMP_TX_TIMEOUT_MS 2000
+
+// The dump can take seconds, so it runs in its own thread to keep the main loop scheduling pictures
+K_SEM_DEFINE(trace_dump_start_sem, 0, 1);
+static nus_tx_stream_t m_trace_dump_tx;
+static atomic_t m_trace_dump_running = ATOMIC_INIT(0);
+
+static int trace_emit_line(const char *line)
+{
+	printk("%s\n", line);
+	if(!m_nus_notifications_enabled) return 0;
+
+	return nus_tx_send(&m_trace_dump_tx, m_conn, line, strlen(line), K_MSEC(TRACE_DUMP_TX_TIMEOUT_MS));
+}
+
+static void trace_dump_thread(void)
+{
+	static char response_msg[32];
+
+	nus_tx_stream_init(&m_trace_dump_tx);
+
+	for (;;) {
+		k_sem_take(&trace_dump_start_sem, K_FOREVER);
+
+		int err = trace_rec_dump(trace_emit_line);
+		// Send the result after the last record line
+		int flush_err = nus_tx_flush(&m_trace_dump_tx, K_MSEC(TRACE_DUMP_TX_TIMEOUT_MS));
+		if(err == 0) err = flush_err;
+		sprintf(response_msg, "Trace dump %s (err %i)", err ? "failed" : "done", err);
+		printk("%s\n", response_msg);
+		send_nus_response_str(response_msg);
+
+		atomic_clear(&m_trace_dump_running);
+	}
+}
+
+K_THREAD_DEFINE(trace_dump_thread_id, TRACE_DUMP_STACK_SIZE, trace_dump_thread, NULL, NULL, NULL,
+		TRACE_DUMP_PRIORITY, 0, 0);
+#endif
 
 typedef struct {
 	uint8_t buf[24];
@@ -258,11 +454,19 @@ K_MSGQ_DEFINE(nus_msg_queue, sizeof(uart_message_t), 8, 4);
 void on_nus_received(struct bt_conn *conn, const uint8_t *const data, uint16_t len)
 {
 	static uart_message_t new_message;
+#if defined(CONFIG_CAM_TL_BLE_BENCH)
+	// Ping echoes are handled here rather than in the main loop to keep the round trip measurement accurate
+	if(len == 6 && strncmp("po", (const char *)data, 2) == 0) {
+		ble_bench_on_ping_echo(convert_ascii_int(data + 2, 4));
+		return;
+	}
+#endif
 	if(len > 23) len = 23;
 	memcpy(new_message.buf, data, len);
 	new_message.buf[len] = 0;
 	new_message.len = len;
 	k_msgq_put(&nus_msg_queue, &new_message, K_NO_WAIT);
+	app_wake();
 }
 
 #define CHECK_CAM_CMD(a, b) (strncmp(a, msg->buf, 2) == 0 && msg->len == b)
@@ -272,6 +476,7 @@ static void process_nus_packet(uart_message_t *msg)
 	struct tm set_time;
 	static char response_msg[128];
 	//printk("NUS CMD received (len %i): %s\n", len, response_msg);
+	APP_TRACE(TRACE_EVT_NUS, msg->buf, msg->len);
 	if(msg->len >= 2){
 		// Set time command
 		if(CHECK_CAM_CMD("st", 14)){
@@ -282,10 +487,7 @@ static void process_nus_packet(uart_message_t *msg)
 			set_time.tm_min = convert_ascii_int(msg->buf + 10, 2);
 			set_time.tm_sec = convert_ascii_int(msg->buf + 12, 2);
 			time_t t = mktime(&set_time);
-			struct timespec ts;
-			ts.tv_sec = t;
-			ts.tv_nsec = 0;
-			clock_settime(CLOCK_REALTIME, &ts);
+			app_set_time(t, TRACE_CLOCK_SRC_NUS);
 			m_time_set_from_app = true;
 			sprintf(response_msg, "Time set over NUS: %s", asctime(&set_time));
 		}
@@ -355,12 +557,78 @@ static void process_nus_packet(uart_message_t *msg)
 			send_nus_response_str(response_msg);
 			sprintf(response_msg, "Pics since reset: %i, pics since BLE activity: %i", m_pics_taken_since_reset, m_pics_taken_since_last_ble_command);
 			send_nus_response_str(response_msg);
+			sprintf(response_msg, "Ext triggers since reset: %i", m_ext_triggers_since_reset);
+			send_nus_response_str(response_msg);
+#if defined(CONFIG_CAM_TL_DOWNTIME_PM)
+			power_state_stats_t pm_stats;
+			power_state_get_stats(&pm_stats);
+			sprintf(response_msg, "Downtime: %u entries, %u wakes, %u s, est %u uAh", pm_stats.downtime_entries,
+					pm_stats.downtime_wakes, pm_stats.downtime_s, pm_stats.downtime_charge_uah);
+			send_nus_response_str(response_msg);
+#endif
+#if defined(CONFIG_CAM_TL_SYNC)
+			sprintf(response_msg, "Sync role: %i, synced: %i, sync pics: %i", sync_capture_get_role(),
+					sync_capture_is_synced(), m_sync_captures_since_reset);
+			send_nus_response_str(response_msg);
+#endif
 			response_msg[0] = 0;
 		}
 		else if(CHECK_CAM_CMD("tp", 2)){
 			take_picture_requested = true;
 			sprintf(response_msg, "Picture request received");
 		}
+#if defined(CONFIG_CAM_TL_BLE_BENCH)
+		// Report link parameters command
+		else if(CHECK_CAM_CMD("bl", 2)){
+			ble_bench_report_link(m_conn);
+			response_msg[0] = 0;
+		}
+		// Throughput benchmark command, streams the given number of bytes
+		else if(CHECK_CAM_CMD("bt", 8)){
+			int err = ble_bench_stream_start(m_conn, convert_ascii_int(msg->buf + 2, 6));
+			sprintf(response_msg, err ? "Benchmark start failed (err %i)" : "Benchmark started", err);
+		}
+		// Latency benchmark command, sends the given number of pings
+		else if(CHECK_CAM_CMD("bp", 5)){
+			int err = ble_bench_ping_start(m_conn, convert_ascii_int(msg->buf + 2, 3));
+			sprintf(response_msg, err ? "Benchmark start failed (err %i)" : "Benchmark started", err);
+		}
+#endif
+#if defined(CONFIG_CAM_TL_SYNC)
+		// Sync role commands: master, follower or off
+		else if(CHECK_CAM_CMD("sm", 2) || CHECK_CAM_CMD("sf", 2) || CHECK_CAM_CMD("so", 2)){
+			sync_role_t role = (msg->buf[1] == 'm') ? SYNC_ROLE_MASTER :
+							   (msg->buf[1] == 'f') ? SYNC_ROLE_FOLLOWER : SYNC_ROLE_NONE;
+			int err = sync_capture_set_role(role);
+			if(err) sprintf(response_msg, "Sync role change failed (err %i)", err);
+			else sprintf(response_msg, "Sync role set to %i", role);
+		}
+		// Synchronized capture command, fires all nodes after the given delay in ms
+		else if(CHECK_CAM_CMD("sx", 6)){
+			int err = sync_capture_fire(convert_ascii_int(msg->buf + 2, 4));
+			sprintf(response_msg, err ? "Sync capture failed (err %i)" : "Sync capture scheduled", err);
+		}
+#endif
+#if defined(CONFIG_CAM_TL_TRACE)
+		// Trace download command
+		else if(CHECK_CAM_CMD("td", 2)){
+			if(atomic_cas(&m_trace_dump_running, 0, 1)) {
+				k_sem_give(&trace_dump_start_sem);
+				sprintf(response_msg, "Trace dump started");
+			} else {
+				sprintf(response_msg, "Trace dump already running");
+			}
+		}
+		// Trace clear command
+		else if(CHECK_CAM_CMD("tc", 2)){
+			if(atomic_get(&m_trace_dump_running)) {
+				sprintf(response_msg, "Trace dump running, not cleared");
+			} else {
+				trace_rec_clear();
+				sprintf(response_msg, "Trace cleared");
+			}
+		}
+#endif
 		else sprintf(response_msg, "Unknown NUS command received!");
 	}
 	printk("%s\n", response_msg);
@@ -381,6 +649,131 @@ void on_nus_send_enabled(enum bt_nus_send_status status)
 
 struct bt_nus_cb nus_callbacks = {.received = on_nus_received, .sent = on_nus_sent, .send_enabled = on_nus_send_enabled};
 
+// Returns the number of seconds until the next active capture window starts, 0 if inside one,
+// or -1 if no weekday is enabled
+static int seconds_until_active(struct tm *ptr)
+{
+	int time_start_minutes = app_settings.pic_cap_start_hour * 60 + app_settings.pic_cap_start_min;
+	int time_end_minutes = app_settings.pic_cap_end_hour * 60 + app_settings.pic_cap_end_min;
+	int current_time_minutes = ptr->tm_hour * 60 + ptr->tm_min;
+
+	// Check up to the same weekday next week, in case today is the only enabled day
+	for(int day = 0; day < 8; day++) {
+		if(!app_settings.wday_on_map[(ptr->tm_wday + day) % 7]) continue;
+		if(day == 0) {
+			if(current_time_minutes >= time_start_minutes && current_time_minutes <= time_end_minutes) return 0;
+			if(current_time_minutes > time_end_minutes) continue;
+		}
+		return (day * 24 * 60 + time_start_minutes - current_time_minutes) * 60 - ptr->tm_sec;
+	}
+	return -1;
+}
+
+// Returns true if the schedule calls for a picture at the given time. This has no side effects,
+// so the trace replay can evaluate it for any time.
+static bool scheduler_capture_due(struct tm *ptr)
+{
+	int second_in_day_offset;
+	int interval;
+
+	// No pictures are scheduled until the time has been set from the app
+	if(!m_time_set_from_app) return false;
+
+	// First check if we are within the active period
+	if(seconds_until_active(ptr) == 0) {
+		interval = app_settings.picture_interval_s;
+	// If we are not within the active period and the downtime interval is 0, no pictures will be taken
+	} else if(app_settings.downtime_pic_int_s == 0) {
+		return false;
+	// Otherwise use the downtime interval
+	} else {
+		interval = app_settings.downtime_pic_int_s;
+	}
+	// In order to make picture capture happen on natural time boundaries, use the modulo operator
+	second_in_day_offset = ptr->tm_hour * 3600 + ptr->tm_min * 60 + ptr->tm_sec;
+	return (second_in_day_offset % interval) == 0;
+}
+
+// While synchronized, the time master drives the schedule of every node with fire commands,
+// so that all nodes capture a slot together instead of each following its own clock
+static bool schedule_synced(void)
+{
+#if defined(CONFIG_CAM_TL_SYNC)
+	sync_role_t role = sync_capture_get_role();
+
+	return role == SYNC_ROLE_MASTER || (role == SYNC_ROLE_FOLLOWER && sync_capture_is_synced());
+#else
+	return false;
+#endif
+}
+
+#if defined(CONFIG_CAM_TL_SYNC)
+// Broadcasts a fire command for each scheduled slot a few seconds ahead, timed to the start of that second
+static void sync_schedule_ahead(void)
+{
+	static time_t checked_until = 0;
+	// Up to a second of the current second may have passed, so the first slot is one second further out
+	// than the minimum fire delay rounded up
+	time_t lead_s = DIV_ROUND_UP(sync_capture_min_fire_delay_ms(), 1000) + 1;
+	struct timespec now;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	// Start over if the clock was set backwards
+	if(checked_until > now.tv_sec + lead_s) checked_until = 0;
+
+	for(time_t slot = MAX(checked_until + 1, now.tv_sec + 1); slot <= now.tv_sec + lead_s; slot++) {
+		if(!scheduler_capture_due(localtime(&slot))) continue;
+
+		// Only reached if this function was not called for more than a second
+		if(slot < now.tv_sec + lead_s) {
+			printk("Scheduled picture skipped, too late for a sync command\n");
+			continue;
+		}
+
+		int err = sync_capture_fire((slot - now.tv_sec) * 1000 - now.tv_nsec / 1000000);
+		if(err == -EBUSY) {
+			printk("Scheduled picture skipped, previous sync command still pending\n");
+		} else if (err) {
+			printk("Sync command for scheduled picture failed (err %d)\n", err);
+		}
+	}
+	checked_until = now.tv_sec + lead_s;
+}
+#endif
+
+// Takes the picture of a due slot, unless it is left to the synchronized capture or the camera is busy
+static trace_capture_t scheduled_capture(struct tm *ptr)
+{
+	if(schedule_synced()) {
+		printk("Scheduled picture at %s left to synchronized capture\n", asctime(ptr));
+		return TRACE_CAPTURE_SYNC;
+	}
+	// If the external trigger is already capturing, that picture covers this slot
+	if(cam_tl_control_take_picture() != 0) {
+		printk("Capture in progress, skipping scheduled picture at %s\n", asctime(ptr));
+		return TRACE_CAPTURE_BUSY;
+	}
+	printk("Taking picture at time %s\n", asctime(ptr));
+	m_pics_taken_since_reset++;
+	m_pics_taken_since_last_ble_command++;
+	return TRACE_CAPTURE_TAKEN;
+}
+
+// Takes a picture requested with the user button or over NUS
+static void manual_capture_process(void)
+{
+	if(!take_picture_requested) return;
+
+	take_picture_requested = false;
+	if(cam_tl_control_take_picture() == 0) {
+		printk("Triggering picture manually\n");
+		m_pics_taken_since_reset++;
+		m_pics_taken_since_last_ble_command++;
+	} else {
+		printk("Capture in progress, manual trigger ignored\n");
+	}
+}
+
 static void time_debug(void)
 {
 	static bool first_time = true;
@@ -388,7 +781,6 @@ static void time_debug(void)
 	struct tm start_time;
     static time_t t;
 	static time_t time_at_last_pic = 0;
-	struct timespec ts;
 
 	if(first_time) {
 		first_time = false;
@@ -399,47 +791,184 @@ static void time_debug(void)
 		start_time.tm_min = 12;
 		start_time.tm_sec = 12;
 		t = mktime(&start_time);
-		ts.tv_sec = t;
-		ts.tv_nsec = 0;
-		clock_settime(CLOCK_REALTIME, &ts);
+		app_set_time(t, TRACE_CLOCK_SRC_BOOT);
 		printk("Time set to: %s", asctime(&start_time));
 	}
 
+#if defined(CONFIG_CAM_TL_SYNC)
+	// Not synced while suspended in downtime
+	if(sync_capture_get_role() == SYNC_ROLE_MASTER && sync_capture_is_synced()) {
+		sync_schedule_ahead();
+	}
+#endif
+
 	// Check current time 
 	t = time(NULL);
     ptr = localtime(&t);
 
-	// Check if this is within the active picture period
-	int second_in_day_offset;
-	int interval;
-	int time_start_minutes = app_settings.pic_cap_start_hour * 60 + app_settings.pic_cap_start_min;
-	int time_end_minutes = app_settings.pic_cap_end_hour * 60 + app_settings.pic_cap_end_min;
-	int current_time_minutes = ptr->tm_hour * 60 + ptr->tm_min; 
-	// If no BLE configuration occurred since reset, use a 30 second interval
-	if(!m_time_set_from_app) {
-		interval = 30;
-	} else {
-		// First check if we are within the active period
-		if(current_time_minutes >= time_start_minutes && current_time_minutes <= time_end_minutes && app_settings.wday_on_map[ptr->tm_wday]) {
-			interval = app_settings.picture_interval_s;
-		// If we are not within the active period and the downtime interval is 0, no pictures will be taken
-		} else if(app_settings.downtime_pic_int_s == 0) {
-			return;
-		// Otherwise use the downtime interval
-		} else {
-			interval = app_settings.downtime_pic_int_s;
-		}
-		// In order to make picture capture happen on natural time boundaries, use the modulo operator
-		second_in_day_offset = ptr->tm_hour * 3600 + ptr->tm_min * 60 + ptr->tm_sec;
-		if((second_in_day_offset % interval) == 0) {
-			time_at_last_pic = t;
-			printk("Taking picture at time %s\n", asctime(ptr));
-			cam_tl_control_take_picture();
-			m_pics_taken_since_reset++;
-			m_pics_taken_since_last_ble_command++;
-		}
+	if(scheduler_capture_due(ptr)) {
+		uint8_t decision = scheduled_capture(ptr);
+
+		time_at_last_pic = t;
+		APP_TRACE(TRACE_EVT_CAPTURE, &decision, sizeof(decision));
+	}
+}
+
+// Runs in interrupt context, the counters are updated from the main loop
+static void on_ext_trigger(void)
+{
+	APP_TRACE(TRACE_EVT_EXT_TRIGGER, NULL, 0);
+	atomic_inc(&m_ext_triggers_pending);
+}
+
+#if defined(CONFIG_CAM_TL_SYNC)
+// Runs in interrupt context, the counters are updated from the main loop
+static void on_sync_capture(void)
+{
+	atomic_inc(&m_sync_captures_pending);
+}
+
+// Follow the wall clock of the time master, with a margin to avoid stepping the clock on every beacon.
+// Scheduled pictures are timed by the fire commands of the master, not by this clock.
+static void on_sync_time(time_t master_time)
+{
+	time_t t = time(NULL);
+
+	if(!m_time_set_from_app || master_time > t + 1 || master_time < t - 1) {
+		app_set_time(master_time, TRACE_CLOCK_SRC_SYNC);
+		m_time_set_from_app = true;
 	}
 }
+#endif
+
+#if defined(CONFIG_CAM_TL_DOWNTIME_PM)
+static int64_t m_wake_until_ms = 0;
+
+// Downtime is only used when no pictures are taken outside the active window,
+// and is left a lead time before the next window starts
+static bool downtime_wanted(void)
+{
+	time_t t;
+	int seconds;
+
+	if(!m_time_set_from_app || app_settings.downtime_pic_int_s != 0) return false;
+	if(m_conn || k_uptime_get() < m_wake_until_ms) return false;
+
+	t = time(NULL);
+	seconds = seconds_until_active(localtime(&t));
+	return seconds < 0 || seconds > CONFIG_CAM_TL_DOWNTIME_RESUME_LEAD_S;
+}
+
+static void downtime_update(void)
+{
+	if(m_wake_requested) {
+		m_wake_requested = false;
+		m_wake_until_ms = k_uptime_get() + CONFIG_CAM_TL_DOWNTIME_WAKE_HOLD_S * 1000;
+	}
+
+	if(downtime_wanted()) {
+		power_state_enter_downtime();
+	} else if(power_state_is_downtime()) {
+		power_state_exit_downtime(m_conn || k_uptime_get() < m_wake_until_ms);
+	}
+	app_bt_set_slow_advertising(power_state_is_downtime());
+}
+#endif
+
+// Updates the downtime state and sleeps while in downtime. Returns true if the main loop slept.
+static bool downtime_sleep(void)
+{
+#if defined(CONFIG_CAM_TL_DOWNTIME_PM)
+	downtime_update();
+	if(!power_state_is_downtime()) return false;
+
+	// Sleep until the next check, or until woken by a button press or connection.
+	// A wake request that arrived while entering downtime is handled straight away.
+	if(!m_wake_requested) k_sleep(K_SECONDS(CONFIG_CAM_TL_DOWNTIME_POLL_S));
+	downtime_update();
+	return true;
+#else
+	return false;
+#endif
+}
+
+#if defined(CONFIG_CAM_TL_TRACE_REPLAY)
+static void settings_unpack(const uint8_t *buf, uint8_t len)
+{
+	if(len < PACKED_SETTINGS_LEN) return;
+
+	app_settings.picture_interval_s = sys_get_le16(&buf[0]);
+	app_settings.downtime_pic_int_s = sys_get_le16(&buf[2]);
+	app_settings.pic_cap_start_hour = buf[4];
+	app_settings.pic_cap_start_min = buf[5];
+	app_settings.pic_cap_end_hour = buf[6];
+	app_settings.pic_cap_end_min = buf[7];
+	for(int i = 0; i < 7; i++) {
+		app_settings.wday_on_map[i] = (buf[8] & BIT(i)) != 0;
+	}
+}
+
+static void replay_boot(const uint8_t *settings, uint8_t len)
+{
+	settings_unpack(settings, len);
+	m_time_set_from_app = false;
+}
+
+static void replay_checkpoint(const uint8_t *settings, uint8_t len, bool time_set)
+{
+	settings_unpack(settings, len);
+	m_time_set_from_app = time_set;
+}
+
+static void replay_nus_packet(const uint8_t *data, uint8_t len)
+{
+	static uart_message_t msg;
+
+	if(len > 23) len = 23;
+	memcpy(msg.buf, data, len);
+	msg.buf[len] = 0;
+	msg.len = len;
+	process_nus_packet(&msg);
+}
+
+static void replay_set_time(time_t t, bool set_from_app)
+{
+	struct timespec ts = {.tv_sec = t, .tv_nsec = 0};
+
+	clock_settime(CLOCK_REALTIME, &ts);
+	if(set_from_app) m_time_set_from_app = true;
+}
+
+static bool replay_scheduler_decide(time_t t)
+{
+	return scheduler_capture_due(localtime(&t));
+}
+
+static trace_capture_t replay_capture(time_t t)
+{
+	return scheduled_capture(localtime(&t));
+}
+
+// The trigger input starts the pulse itself, so only the camera activity is reproduced
+static void replay_ext_trigger(void)
+{
+	cam_tl_control_take_picture();
+}
+
+static const trace_replay_hooks_t replay_hooks = {
+	.boot = replay_boot,
+	.checkpoint = replay_checkpoint,
+	.set_settings = settings_unpack,
+	.nus_packet = replay_nus_packet,
+	.button = button_changed,
+	.set_time = replay_set_time,
+	.scheduler_decide = replay_scheduler_decide,
+	.capture = replay_capture,
+	.ext_trigger = replay_ext_trigger,
+	.poll = manual_capture_process,
+	.get_settings = settings_pack,
+};
+#endif
 
 static bool bt_is_enabled = false;
 void bt_ready(int error)
@@ -453,7 +982,24 @@ void main(void)
 
 	printk("Starting Camera timelapse control example\n");
 
-	cam_tl_control_init();
+#if defined(CONFIG_CAM_TL_DOWNTIME_PM)
+	m_main_thread = k_current_get();
+#endif
+
+	static const cam_tl_control_config_t cam_config = {.ext_trigger_cb = on_ext_trigger};
+	err = cam_tl_control_init(&cam_config);
+	if (err) {
+		printk("Camera control init failed (err %d)\n", err);
+	}
+
+#if defined(CONFIG_CAM_TL_TRACE_REPLAY)
+	// Feed the recorded trace through the same handlers instead of running normally
+	err = trace_replay_run(&replay_hooks);
+#if defined(CONFIG_ARCH_POSIX)
+	posix_exit(err == CONFIG_CAM_TL_TRACE_REPLAY_EXPECTED_DIVERGENCES ? 0 : 1);
+#endif
+	return;
+#endif
 
 	err = dk_leds_init();
 	if (err) {
@@ -490,6 +1036,11 @@ void main(void)
 		printk("ERROR writing flash\n");
 	}
 
+#if defined(CONFIG_CAM_TL_TRACE)
+	trace_rec_init();
+	app_trace_settings(TRACE_EVT_BOOT);
+#endif
+
 	err = bt_enable(NULL);
 	if (err) {
 		printk("Bluetooth init failed (err %d)\n", err);
@@ -510,24 +1061,51 @@ void main(void)
 
 	app_bt_start_advertising(true);
 
+#if defined(CONFIG_CAM_TL_DOWNTIME_PM)
+	err = power_state_init();
+	if (err) {
+		printk("Power state init failed (err %d)\n", err);
+	}
+#endif
+
+#if defined(CONFIG_CAM_TL_SYNC)
+	static const sync_capture_config_t sync_config = {.time_received = on_sync_time,
+													  .capture_fired = on_sync_capture};
+	err = sync_capture_init(&sync_config);
+	if (err) {
+		printk("Sync capture init failed (err %d)\n", err);
+	}
+#endif
+
 	printk("Advertising successfully started\n");
 	static char printbuf[128];
 	static time_t t;
 	static struct tm *ptr;
 	uint32_t time_debug_counter = 0;
 	for (;;) {
-		dk_set_led(RUN_STATUS_LED, 1);
-		k_msleep(10);
-		dk_set_led(RUN_STATUS_LED, 0);
-		k_sleep(K_MSEC(RUN_LED_BLINK_INTERVAL - 10));
+		if(!downtime_sleep()) {
+			dk_set_led(RUN_STATUS_LED, 1);
+			k_msleep(10);
+			dk_set_led(RUN_STATUS_LED, 0);
+			k_sleep(K_MSEC(RUN_LED_BLINK_INTERVAL - 10));
+		}
 
 		// If the user button is pressed, take a picture
-		if(take_picture_requested) {
-			take_picture_requested = false;
-			printk("Triggering picture manually\n");
-			cam_tl_control_take_picture();
-			m_pics_taken_since_reset++;
-			m_pics_taken_since_last_ble_command++;
+		manual_capture_process();
+
+		int ext_triggers = atomic_set(&m_ext_triggers_pending, 0);
+		if(ext_triggers > 0) {
+			printk("External trigger fired %i time(s)\n", ext_triggers);
+			m_ext_triggers_since_reset += ext_triggers;
+			m_pics_taken_since_reset += ext_triggers;
+			m_pics_taken_since_last_ble_command += ext_triggers;
+		}
+
+		int sync_captures = atomic_set(&m_sync_captures_pending, 0);
+		if(sync_captures > 0) {
+			m_sync_captures_since_reset += sync_captures;
+			m_pics_taken_since_reset += sync_captures;
+			m_pics_taken_since_last_ble_command += sync_captures;
 		}
 
 		if(time_update_requested) {
@@ -548,6 +1126,9 @@ void main(void)
 			if (err) {
 				printk("Flash write error (err %i)\n", err);
 			}
+#if defined(CONFIG_CAM_TL_TRACE)
+			app_trace_settings(TRACE_EVT_SETTINGS);
+#endif
 		}
 
 		if(time_debug_counter > 1000) {
@@ -560,5 +1141,9 @@ void main(void)
 		if(k_msgq_get(&nus_msg_queue, &new_msg, K_NO_WAIT) == 0) {
 			process_nus_packet(&new_msg);
 		}
+
+#if defined(CONFIG_CAM_TL_TRACE)
+		trace_rec_process();
+#endif
 	}
 }
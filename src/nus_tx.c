@@ -0,0 +1,69 @@
+#include "nus_tx.h"
+
+#include <zephyr/bluetooth/gatt.h>
+#include <bluetooth/services/nus.h>
+
+// TX slots shared by all streams, taken per notification and returned by its completion callback
+K_SEM_DEFINE(nus_tx_slots, CONFIG_BT_CONN_TX_MAX, CONFIG_BT_CONN_TX_MAX);
+
+static const struct bt_gatt_attr *m_tx_attr;
+
+static void nus_tx_complete(struct bt_conn *conn, void *user_data)
+{
+	nus_tx_stream_t *stream = user_data;
+
+	atomic_dec(&stream->in_flight);
+	k_sem_give(&nus_tx_slots);
+	k_sem_give(&stream->completed);
+}
+
+void nus_tx_stream_init(nus_tx_stream_t *stream)
+{
+	atomic_clear(&stream->in_flight);
+	k_sem_init(&stream->completed, 0, K_SEM_MAX_LIMIT);
+}
+
+int nus_tx_send(nus_tx_stream_t *stream, struct bt_conn *conn, const void *data, uint16_t len,
+		k_timeout_t timeout)
+{
+	struct bt_gatt_notify_params params = {0};
+	int err;
+
+	if(m_tx_attr == NULL) {
+		m_tx_attr = bt_gatt_find_by_uuid(NULL, 0, BT_UUID_NUS_TX);
+		if(m_tx_attr == NULL) {
+			return -ENOENT;
+		}
+	}
+	if(conn == NULL || !bt_gatt_is_subscribed(conn, m_tx_attr, BT_GATT_CCC_NOTIFY)) {
+		return -EINVAL;
+	}
+
+	if(k_sem_take(&nus_tx_slots, timeout) != 0) {
+		return -ETIMEDOUT;
+	}
+
+	params.attr = m_tx_attr;
+	params.data = data;
+	params.len = len;
+	params.func = nus_tx_complete;
+	params.user_data = stream;
+
+	atomic_inc(&stream->in_flight);
+	err = bt_gatt_notify_cb(conn, &params);
+	if (err) {
+		atomic_dec(&stream->in_flight);
+		k_sem_give(&nus_tx_slots);
+	}
+	return err;
+}
+
+int nus_tx_flush(nus_tx_stream_t *stream, k_timeout_t timeout)
+{
+	while(atomic_get(&stream->in_flight) > 0) {
+		if(k_sem_take(&stream->completed, timeout) != 0) {
+			return -ETIMEDOUT;
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,26 @@
+#ifndef __NUS_TX_H
+#define __NUS_TX_H
+
+#include <zephyr/kernel.h>
+#include <zephyr/bluetooth/conn.h>
+
+// Back to back NUS notifications from one sender. Each stream only counts completions of its own
+// notifications, so other NUS traffic does not affect its pacing.
+typedef struct {
+    atomic_t in_flight;
+    struct k_sem completed;
+} nus_tx_stream_t;
+
+// Must not be called while notifications of the stream are in flight
+void nus_tx_stream_init(nus_tx_stream_t *stream);
+
+// Sends a notification on the NUS TX characteristic, waiting up to timeout for a free TX slot.
+// The slots are shared by all streams, so at most CONFIG_BT_CONN_TX_MAX stream notifications are queued.
+int nus_tx_send(nus_tx_stream_t *stream, struct bt_conn *conn, const void *data, uint16_t len,
+                k_timeout_t timeout);
+
+// Waits until every notification sent on the stream has been handed to the controller.
+// The timeout applies to each completion.
+int nus_tx_flush(nus_tx_stream_t *stream, k_timeout_t timeout);
+
+#endif
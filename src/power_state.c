@@ -0,0 +1,124 @@
+#include "power_state.h"
+#include "cam_tl_control.h"
+#if defined(CONFIG_CAM_TL_SYNC)
+#include "sync_capture.h"
+#endif
+
+#include <zephyr/device.h>
+#include <zephyr/pm/device.h>
+#include <zephyr/pm/device_runtime.h>
+
+#include <dk_buttons_and_leds.h>
+
+#if DT_HAS_CHOSEN(zephyr_console)
+static const struct device *const console_dev = DEVICE_DT_GET(DT_CHOSEN(zephyr_console));
+#else
+static const struct device *const console_dev = NULL;
+#endif
+
+static bool m_downtime = false;
+static int64_t m_downtime_start_ms;
+static power_state_stats_t m_stats;
+
+int power_state_init(void)
+{
+	int err;
+
+	if(console_dev == NULL || !device_is_ready(console_dev)) {
+		return 0;
+	}
+
+	// Enabling runtime PM suspends the device until it is requested, so take a reference straight away
+	err = pm_device_runtime_enable(console_dev);
+	if (err) {
+		printk("Console runtime PM not available (err %d)\n", err);
+		return err;
+	}
+	return pm_device_runtime_get(console_dev);
+}
+
+int power_state_enter_downtime(void)
+{
+	int err;
+
+	if(m_downtime) {
+		return 0;
+	}
+
+	printk("Entering downtime\n");
+
+	dk_set_leds(DK_NO_LEDS_MSK);
+
+	err = cam_tl_control_set_low_power(true);
+	if (err) {
+		printk("Failed to suspend camera interface (err %d)\n", err);
+	}
+
+#if defined(CONFIG_CAM_TL_SYNC)
+	sync_capture_suspend(true);
+#endif
+
+	if(console_dev && pm_device_runtime_is_enabled(console_dev)) {
+		err = pm_device_runtime_put(console_dev);
+		if (err) {
+			printk("Failed to suspend console (err %d)\n", err);
+		}
+	}
+
+	m_downtime = true;
+	m_downtime_start_ms = k_uptime_get();
+	m_stats.downtime_entries++;
+	return 0;
+}
+
+int power_state_exit_downtime(bool early_wake)
+{
+	int err;
+
+	if(!m_downtime) {
+		return 0;
+	}
+
+	if(console_dev && pm_device_runtime_is_enabled(console_dev)) {
+		err = pm_device_runtime_get(console_dev);
+		if (err) {
+			return err;
+		}
+	}
+
+	err = cam_tl_control_set_low_power(false);
+	if (err) {
+		printk("Failed to resume camera interface (err %d)\n", err);
+	}
+
+#if defined(CONFIG_CAM_TL_SYNC)
+	err = sync_capture_suspend(false);
+	if (err) {
+		printk("Failed to resume synchronized capture (err %d)\n", err);
+	}
+#endif
+
+	m_stats.downtime_s += (uint32_t)((k_uptime_get() - m_downtime_start_ms) / 1000);
+	if(early_wake) {
+		m_stats.downtime_wakes++;
+	}
+	m_downtime = false;
+
+	printk("Leaving downtime%s\n", early_wake ? " (woken up)" : "");
+	return 0;
+}
+
+bool power_state_is_downtime(void)
+{
+	return m_downtime;
+}
+
+void power_state_get_stats(power_state_stats_t *stats)
+{
+	*stats = m_stats;
+	if(m_downtime) {
+		stats->downtime_s += (uint32_t)((k_uptime_get() - m_downtime_start_ms) / 1000);
+	}
+	// No current measurement is available, so the charge is estimated from the configured sleep current
+	stats->downtime_charge_uah = (uint32_t)(((uint64_t)stats->downtime_s * CONFIG_CAM_TL_DOWNTIME_CURRENT_UA) / 3600);
+}
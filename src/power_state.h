@@ -0,0 +1,29 @@
+#ifndef __POWER_STATE_H
+#define __POWER_STATE_H
+
+#include <zephyr/kernel.h>
+
+typedef struct {
+    // Number of times downtime was entered
+    uint32_t downtime_entries;
+    // Number of times downtime was left early because of a button press or connection
+    uint32_t downtime_wakes;
+    // Total time spent in downtime, including the current period
+    uint32_t downtime_s;
+    // Estimated charge used in downtime, based on CONFIG_CAM_TL_DOWNTIME_CURRENT_UA
+    uint32_t downtime_charge_uah;
+} power_state_stats_t;
+
+int power_state_init(void);
+
+// Suspends the console, LEDs, trigger input and synchronized capture radio activity
+int power_state_enter_downtime(void);
+
+// Resumes everything suspended by power_state_enter_downtime. Set early_wake if leaving before the next active window.
+int power_state_exit_downtime(bool early_wake);
+
+bool power_state_is_downtime(void);
+
+void power_state_get_stats(power_state_stats_t *stats);
+
+#endif
@@ -0,0 +1,430 @@
+#include "sync_capture.h"
+#include "cam_tl_control.h"
+
+#include <string.h>
+
+#include <zephyr/sys/byteorder.h>
+#include <zephyr/bluetooth/bluetooth.h>
+#include <zephyr/bluetooth/hci.h>
+
+// Nordic Semiconductor company ID, followed by a marker identifying the timelapse controller beacon
+#define SYNC_COMPANY_ID         0x0059
+#define SYNC_BEACON_MAGIC       0x54
+#define SYNC_BEACON_VERSION     1
+
+// Periodic advertising interval is given in units of 1.25 ms
+#define SYNC_PA_INTERVAL_UNITS  ((CONFIG_CAM_TL_SYNC_PA_INTERVAL_MS * 4) / 5)
+// A fire command must stay on air for several periodic advertising events, so that followers missing one event still see it
+#define SYNC_MIN_FIRE_EVENTS    4
+
+typedef struct __packed {
+	uint16_t company_id;
+	uint8_t magic;
+	uint8_t version;
+	// Wall clock of the master in seconds, refreshed every second
+	uint32_t master_time;
+	// Incremented for every fire command
+	uint8_t cmd_id;
+	// Followers fire this long after receiving the first event carrying a new cmd_id
+	uint16_t fire_delay_ms;
+} sync_beacon_t;
+
+static sync_capture_config_t m_config;
+static sync_role_t m_role = SYNC_ROLE_NONE;
+
+static struct bt_le_ext_adv *m_adv;
+static sync_beacon_t m_beacon = {.magic = SYNC_BEACON_MAGIC, .version = SYNC_BEACON_VERSION};
+K_MUTEX_DEFINE(beacon_mutex);
+// Every node has a single fire timer, so a new command must not go on air before the last one has fired
+static int64_t m_fire_pending_until_ticks;
+
+static struct bt_le_per_adv_sync *m_sync;
+static bt_addr_le_t m_pa_addr;
+static uint8_t m_pa_sid;
+static uint16_t m_pa_interval;
+static volatile bool m_synced = false;
+// Radio activity is stopped in downtime, the role is kept and resumed afterwards
+static bool m_suspended = false;
+static bool m_have_cmd_id = false;
+static uint8_t m_last_cmd_id;
+static int64_t m_last_rx_ticks;
+
+static void fire_timer_handler(struct k_timer *timer)
+{
+	int err = cam_tl_control_take_picture();
+
+	if(err == 0) {
+		printk("Sync capture at %llu us\n", k_ticks_to_us_floor64(k_uptime_ticks()));
+		if(m_config.capture_fired) m_config.capture_fired();
+	} else {
+		printk("Sync capture dropped, camera busy (err %d)\n", err);
+	}
+}
+K_TIMER_DEFINE(fire_timer, fire_timer_handler, NULL);
+
+// Schedules a capture so that the shutter is activated at the given uptime
+static void schedule_fire(int64_t shutter_ticks)
+{
+	int64_t start_ticks = shutter_ticks - k_ms_to_ticks_ceil64(cam_tl_control_shutter_lead_ms());
+
+	k_timer_start(&fire_timer, K_TIMEOUT_ABS_TICKS(start_ticks), K_NO_WAIT);
+}
+
+int sync_capture_min_fire_delay_ms(void)
+{
+	return SYNC_MIN_FIRE_EVENTS * CONFIG_CAM_TL_SYNC_PA_INTERVAL_MS + cam_tl_control_shutter_lead_ms();
+}
+
+/* Master role */
+
+static int beacon_update(void)
+{
+	struct bt_data ad = BT_DATA(BT_DATA_MANUFACTURER_DATA, &m_beacon, sizeof(m_beacon));
+
+	m_beacon.company_id = sys_cpu_to_le16(SYNC_COMPANY_ID);
+	m_beacon.master_time = sys_cpu_to_le32((uint32_t)time(NULL));
+	return bt_le_per_adv_set_data(m_adv, &ad, 1);
+}
+
+static void beacon_work_handler(struct k_work *work);
+K_WORK_DELAYABLE_DEFINE(beacon_work, beacon_work_handler);
+
+static void beacon_work_handler(struct k_work *work)
+{
+	k_mutex_lock(&beacon_mutex, K_FOREVER);
+	beacon_update();
+	k_mutex_unlock(&beacon_mutex);
+	k_work_reschedule(&beacon_work, K_SECONDS(1));
+}
+
+#if (CONFIG_CAM_TL_SYNC_AUTO_FIRE_INTERVAL_S > 0)
+static void auto_fire_work_handler(struct k_work *work);
+K_WORK_DELAYABLE_DEFINE(auto_fire_work, auto_fire_work_handler);
+
+static void auto_fire_work_handler(struct k_work *work)
+{
+	sync_capture_fire(CONFIG_CAM_TL_SYNC_FIRE_DELAY_MS);
+	k_work_reschedule(&auto_fire_work, K_SECONDS(CONFIG_CAM_TL_SYNC_AUTO_FIRE_INTERVAL_S));
+}
+#endif
+
+static int master_start(void)
+{
+	// The extended advertising data only carries the marker, so followers can find the train
+	static const uint8_t marker[] = {SYNC_COMPANY_ID & 0xFF, SYNC_COMPANY_ID >> 8, SYNC_BEACON_MAGIC};
+	static const struct bt_data ad[] = {
+		BT_DATA(BT_DATA_MANUFACTURER_DATA, marker, sizeof(marker)),
+	};
+	int err;
+
+	if(m_adv == NULL) {
+		err = bt_le_ext_adv_create(BT_LE_EXT_ADV_NCONN, NULL, &m_adv);
+		if (err) {
+			printk("Failed to create sync advertising set (err %d)\n", err);
+			return err;
+		}
+
+		err = bt_le_per_adv_set_param(m_adv,
+				BT_LE_PER_ADV_PARAM(SYNC_PA_INTERVAL_UNITS, SYNC_PA_INTERVAL_UNITS, BT_LE_PER_ADV_OPT_NONE));
+		if (err) {
+			printk("Failed to set periodic advertising parameters (err %d)\n", err);
+			return err;
+		}
+
+		err = bt_le_ext_adv_set_data(m_adv, ad, ARRAY_SIZE(ad), NULL, 0);
+		if (err) {
+			return err;
+		}
+	}
+
+	k_mutex_lock(&beacon_mutex, K_FOREVER);
+	err = beacon_update();
+	k_mutex_unlock(&beacon_mutex);
+	if (err) {
+		return err;
+	}
+
+	err = bt_le_per_adv_start(m_adv);
+	if (err) {
+		printk("Failed to start periodic advertising (err %d)\n", err);
+		return err;
+	}
+
+	err = bt_le_ext_adv_start(m_adv, BT_LE_EXT_ADV_START_DEFAULT);
+	if (err) {
+		printk("Failed to start sync advertising (err %d)\n", err);
+		return err;
+	}
+
+	k_work_reschedule(&beacon_work, K_SECONDS(1));
+#if (CONFIG_CAM_TL_SYNC_AUTO_FIRE_INTERVAL_S > 0)
+	k_work_reschedule(&auto_fire_work, K_SECONDS(CONFIG_CAM_TL_SYNC_AUTO_FIRE_INTERVAL_S));
+#endif
+	return 0;
+}
+
+static void master_stop(void)
+{
+	k_work_cancel_delayable(&beacon_work);
+#if (CONFIG_CAM_TL_SYNC_AUTO_FIRE_INTERVAL_S > 0)
+	k_work_cancel_delayable(&auto_fire_work);
+#endif
+	if(m_adv) {
+		bt_le_ext_adv_stop(m_adv);
+		bt_le_per_adv_stop(m_adv);
+	}
+}
+
+int sync_capture_fire(uint16_t delay_ms)
+{
+	int err;
+
+	if(m_role != SYNC_ROLE_MASTER) {
+		return -EPERM;
+	}
+	if(delay_ms < sync_capture_min_fire_delay_ms()) {
+		return -EINVAL;
+	}
+
+	k_mutex_lock(&beacon_mutex, K_FOREVER);
+	int64_t now_ticks = k_uptime_ticks();
+	if(now_ticks < m_fire_pending_until_ticks) {
+		k_mutex_unlock(&beacon_mutex);
+		return -EBUSY;
+	}
+	m_beacon.cmd_id++;
+	m_beacon.fire_delay_ms = sys_cpu_to_le16(delay_ms);
+	err = beacon_update();
+	if(err == 0) {
+		// Followers fire delay_ms after the first event carrying the command, at most one interval from now
+		m_fire_pending_until_ticks = now_ticks + k_ms_to_ticks_ceil64(delay_ms + CONFIG_CAM_TL_SYNC_PA_INTERVAL_MS);
+	}
+	k_mutex_unlock(&beacon_mutex);
+	if (err) {
+		return err;
+	}
+
+	// The new data goes on air at the next periodic advertising event, on average half an interval from now
+	if(IS_ENABLED(CONFIG_CAM_TL_SYNC_MASTER_CAPTURE)) {
+		schedule_fire(now_ticks + k_ms_to_ticks_ceil64(delay_ms + CONFIG_CAM_TL_SYNC_PA_INTERVAL_MS / 2));
+	}
+	return 0;
+}
+
+/* Follower role */
+
+static bool beacon_parse_cb(struct bt_data *data, void *user_data)
+{
+	sync_beacon_t *beacon = user_data;
+
+	if(data->type == BT_DATA_MANUFACTURER_DATA && data->data_len >= 3 &&
+	   sys_get_le16(data->data) == SYNC_COMPANY_ID && data->data[2] == SYNC_BEACON_MAGIC) {
+		memcpy(beacon, data->data, MIN(data->data_len, sizeof(*beacon)));
+		return false;
+	}
+	return true;
+}
+
+static void sync_create_work_handler(struct k_work *work)
+{
+	struct bt_le_per_adv_sync_param param = {0};
+	int err;
+
+	if(m_role != SYNC_ROLE_FOLLOWER || m_sync || m_suspended) {
+		return;
+	}
+
+	bt_addr_le_copy(&param.addr, &m_pa_addr);
+	param.sid = m_pa_sid;
+	param.skip = 0;
+	// Drop the sync after roughly 10 missed events. Timeout is given in units of 10 ms.
+	param.timeout = CLAMP((m_pa_interval * 5) / 4, 10, 0x4000);
+
+	err = bt_le_per_adv_sync_create(&param, &m_sync);
+	if (err) {
+		printk("Failed to create periodic advertising sync (err %d)\n", err);
+		m_sync = NULL;
+	}
+}
+K_WORK_DEFINE(sync_create_work, sync_create_work_handler);
+
+static void scan_work_handler(struct k_work *work)
+{
+	if(m_role == SYNC_ROLE_FOLLOWER && !m_synced && !m_suspended) {
+		bt_le_scan_start(BT_LE_SCAN_PASSIVE, NULL);
+	} else {
+		bt_le_scan_stop();
+	}
+}
+K_WORK_DEFINE(scan_work, scan_work_handler);
+
+static void scan_recv(const struct bt_le_scan_recv_info *info, struct net_buf_simple *buf)
+{
+	sync_beacon_t beacon = {0};
+
+	if(m_role != SYNC_ROLE_FOLLOWER || m_sync || m_suspended || info->interval == 0) {
+		return;
+	}
+
+	bt_data_parse(buf, beacon_parse_cb, &beacon);
+	if(beacon.magic != SYNC_BEACON_MAGIC) {
+		return;
+	}
+
+	bt_addr_le_copy(&m_pa_addr, info->addr);
+	m_pa_sid = info->sid;
+	m_pa_interval = info->interval;
+	k_work_submit(&sync_create_work);
+}
+
+static struct bt_le_scan_cb scan_callbacks = {
+	.recv = scan_recv,
+};
+
+static void sync_synced(struct bt_le_per_adv_sync *sync, struct bt_le_per_adv_sync_synced_info *info)
+{
+	printk("Synced to time master, interval %u.%02u ms\n", (info->interval * 125) / 100, (info->interval * 125) % 100);
+	m_pa_interval = info->interval;
+	m_have_cmd_id = false;
+	m_last_rx_ticks = k_uptime_ticks();
+	m_synced = true;
+	k_work_submit(&scan_work);
+}
+
+static void sync_term(struct bt_le_per_adv_sync *sync, const struct bt_le_per_adv_sync_term_info *info)
+{
+	printk("Lost sync to time master (reason %u)\n", info->reason);
+	m_sync = NULL;
+	m_synced = false;
+	k_work_submit(&scan_work);
+}
+
+static void sync_recv(struct bt_le_per_adv_sync *sync, const struct bt_le_per_adv_sync_recv_info *info,
+					  struct net_buf_simple *buf)
+{
+	// Timestamp before anything else. All followers receive the same event, so this is the shared reference.
+	int64_t rx_ticks = k_uptime_ticks();
+	int64_t gap_ticks = rx_ticks - m_last_rx_ticks;
+	sync_beacon_t beacon = {0};
+
+	m_last_rx_ticks = rx_ticks;
+
+	bt_data_parse(buf, beacon_parse_cb, &beacon);
+	if(beacon.magic != SYNC_BEACON_MAGIC || beacon.version != SYNC_BEACON_VERSION) {
+		return;
+	}
+
+	if(m_config.time_received) {
+		m_config.time_received((time_t)sys_le32_to_cpu(beacon.master_time));
+	}
+
+	// The first command seen after syncing may already have fired on the other nodes
+	if(!m_have_cmd_id) {
+		m_have_cmd_id = true;
+		m_last_cmd_id = beacon.cmd_id;
+		return;
+	}
+	if(beacon.cmd_id == m_last_cmd_id) {
+		return;
+	}
+	m_last_cmd_id = beacon.cmd_id;
+
+	// If events were missed, the command may have been on air earlier and this node will fire late
+	if(gap_ticks > k_us_to_ticks_ceil64((m_pa_interval * 1250 * 3) / 2)) {
+		printk("Sync command received after missed events, capture may be late by up to %u ms\n",
+			   (uint32_t)k_ticks_to_ms_floor64(gap_ticks));
+	}
+	schedule_fire(rx_ticks + k_ms_to_ticks_ceil64(sys_le16_to_cpu(beacon.fire_delay_ms)));
+}
+
+static struct bt_le_per_adv_sync_cb sync_callbacks = {
+	.synced = sync_synced,
+	.term = sync_term,
+	.recv = sync_recv,
+};
+
+static void follower_stop(void)
+{
+	if(m_sync) {
+		bt_le_per_adv_sync_delete(m_sync);
+		m_sync = NULL;
+	}
+	m_synced = false;
+	bt_le_scan_stop();
+}
+
+/* Common */
+
+int sync_capture_init(const sync_capture_config_t *config)
+{
+	if(config) {
+		m_config = *config;
+	}
+
+	bt_le_scan_cb_register(&scan_callbacks);
+	bt_le_per_adv_sync_cb_register(&sync_callbacks);
+
+	if(IS_ENABLED(CONFIG_CAM_TL_SYNC_ROLE_MASTER)) {
+		return sync_capture_set_role(SYNC_ROLE_MASTER);
+	} else if(IS_ENABLED(CONFIG_CAM_TL_SYNC_ROLE_FOLLOWER)) {
+		return sync_capture_set_role(SYNC_ROLE_FOLLOWER);
+	}
+	return 0;
+}
+
+static void role_stop(void)
+{
+	if(m_role == SYNC_ROLE_MASTER) {
+		master_stop();
+	} else if(m_role == SYNC_ROLE_FOLLOWER) {
+		follower_stop();
+	}
+	k_timer_stop(&fire_timer);
+}
+
+static int role_start(void)
+{
+	if(m_role == SYNC_ROLE_MASTER) {
+		return master_start();
+	} else if(m_role == SYNC_ROLE_FOLLOWER) {
+		return bt_le_scan_start(BT_LE_SCAN_PASSIVE, NULL);
+	}
+	return 0;
+}
+
+int sync_capture_set_role(sync_role_t role)
+{
+	if(role == m_role) {
+		return 0;
+	}
+
+	if(!m_suspended) {
+		role_stop();
+	}
+	m_role = role;
+	return m_suspended ? 0 : role_start();
+}
+
+int sync_capture_suspend(bool suspend)
+{
+	if(suspend == m_suspended) {
+		return 0;
+	}
+
+	m_suspended = suspend;
+	if(suspend) {
+		role_stop();
+		return 0;
+	}
+	return role_start();
+}
+
+sync_role_t sync_capture_get_role(void)
+{
+	return m_role;
+}
+
+bool sync_capture_is_synced(void)
+{
+	return !m_suspended && (m_role == SYNC_ROLE_MASTER || m_synced);
+}
@@ -0,0 +1,38 @@
+#ifndef __SYNC_CAPTURE_H
+#define __SYNC_CAPTURE_H
+
+#include <zephyr/kernel.h>
+#include <time.h>
+
+typedef enum {
+    SYNC_ROLE_NONE,
+    SYNC_ROLE_MASTER,
+    SYNC_ROLE_FOLLOWER,
+} sync_role_t;
+
+typedef struct {
+    // Called with the wall clock time of the master whenever a follower receives a beacon
+    void (*time_received)(time_t master_time);
+    // Called from interrupt context when a synchronized capture has been started
+    void (*capture_fired)(void);
+} sync_capture_config_t;
+
+int sync_capture_init(const sync_capture_config_t *config);
+
+int sync_capture_set_role(sync_role_t role);
+
+sync_role_t sync_capture_get_role(void);
+
+bool sync_capture_is_synced(void);
+
+// Stops the periodic advertising train or the scan and sync of the current role, and restarts it when resumed
+int sync_capture_suspend(bool suspend);
+
+// Master only: broadcast a command to fire all nodes delay_ms from now.
+// Returns -EBUSY until the previous command has fired on all nodes.
+int sync_capture_fire(uint16_t delay_ms);
+
+// Shortest delay accepted by sync_capture_fire
+int sync_capture_min_fire_delay_ms(void);
+
+#endif
@@ -0,0 +1,268 @@
+#include "trace_rec.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <zephyr/spinlock.h>
+#include <zephyr/sys/byteorder.h>
+
+#if defined(CONFIG_CAM_TL_TRACE_FLASH_SPILL)
+#include "flash_handler.h"
+
+// Records are spilled to flash in blocks, stored in a ring of NVS entries
+#define TRACE_SPILL_BLOCK_RECORDS 16
+#define TRACE_NVS_ID_META         0x100
+#define TRACE_NVS_ID_BLOCK_BASE   0x101
+
+BUILD_ASSERT(CONFIG_CAM_TL_TRACE_RECORDS >= 2 * TRACE_SPILL_BLOCK_RECORDS,
+	     "The RAM trace must hold at least two spill blocks");
+#endif
+
+// Application state at a point of the trace, enough for a replay to start there
+typedef struct {
+	uint8_t flags;
+	uint8_t settings_len;
+	uint8_t settings[TRACE_DATA_MAX - 1];
+} trace_state_t;
+
+static trace_record_t m_records[CONFIG_CAM_TL_TRACE_RECORDS];
+// Number of records written since the trace was cleared. The RAM ring holds the last CONFIG_CAM_TL_TRACE_RECORDS.
+static uint32_t m_total;
+// Number of records moved to flash, these no longer need to be kept in RAM
+static uint32_t m_spilled;
+// State after the newest record, and before the oldest record still held in RAM
+static trace_state_t m_state_now;
+static trace_state_t m_state_ram;
+static struct k_spinlock m_lock;
+
+#if defined(CONFIG_CAM_TL_TRACE_FLASH_SPILL)
+// Each block starts with the state before its first record, so a dump can start at any block
+typedef struct {
+	trace_state_t checkpoint;
+	trace_record_t records[TRACE_SPILL_BLOCK_RECORDS];
+} trace_spill_block_t;
+
+// Blocks written to flash, kept across resets so a trace from before a reset can be downloaded
+static uint32_t m_blocks_written;
+static trace_spill_block_t m_spill_block;
+// Held while spilling a block and for the whole dump, so the dump sees a consistent split between flash and RAM
+K_MUTEX_DEFINE(trace_spill_mutex);
+#endif
+
+int trace_rec_init(void)
+{
+#if defined(CONFIG_CAM_TL_TRACE_FLASH_SPILL)
+	if(flash_handler_read_block(TRACE_NVS_ID_META, &m_blocks_written, sizeof(m_blocks_written)) !=
+	   sizeof(m_blocks_written)) {
+		m_blocks_written = 0;
+	}
+#endif
+	return 0;
+}
+
+// Updates the state with the settings and time set flag carried by a record
+static void state_apply(trace_state_t *state, const trace_record_t *record)
+{
+	switch(record->type) {
+		case TRACE_EVT_BOOT:
+		case TRACE_EVT_SETTINGS:
+			if(record->type == TRACE_EVT_BOOT) state->flags = 0;
+			state->settings_len = MIN(record->len, sizeof(state->settings));
+			memcpy(state->settings, record->data, state->settings_len);
+			break;
+		case TRACE_EVT_CLOCK_SET:
+			if(record->data[4] != TRACE_CLOCK_SRC_BOOT) state->flags |= TRACE_CHECKPOINT_TIME_SET;
+			break;
+	}
+}
+
+// Index of the oldest record still held in RAM
+static uint32_t oldest_in_ram(void)
+{
+	uint32_t oldest = (m_total > CONFIG_CAM_TL_TRACE_RECORDS) ? (m_total - CONFIG_CAM_TL_TRACE_RECORDS) : 0;
+
+	return MAX(oldest, m_spilled);
+}
+
+void trace_rec_record(trace_evt_t type, const void *data, uint8_t len)
+{
+	uint32_t uptime_ms = k_uptime_get_32();
+	uint32_t realtime = (uint32_t)time(NULL);
+	k_spinlock_key_t key = k_spin_lock(&m_lock);
+	trace_record_t *record = &m_records[m_total % CONFIG_CAM_TL_TRACE_RECORDS];
+
+	// The oldest record is about to be overwritten before it was spilled
+	if(m_total >= CONFIG_CAM_TL_TRACE_RECORDS && oldest_in_ram() == m_total - CONFIG_CAM_TL_TRACE_RECORDS) {
+		state_apply(&m_state_ram, record);
+	}
+
+	if(len > TRACE_DATA_MAX) len = TRACE_DATA_MAX;
+	record->uptime_ms = sys_cpu_to_le32(uptime_ms);
+	record->realtime = sys_cpu_to_le32(realtime);
+	record->type = type;
+	record->len = len;
+	memcpy(record->data, data, len);
+	memset(record->data + len, 0, TRACE_DATA_MAX - len);
+	state_apply(&m_state_now, record);
+	m_total++;
+
+	k_spin_unlock(&m_lock, key);
+}
+
+void trace_rec_process(void)
+{
+#if defined(CONFIG_CAM_TL_TRACE_FLASH_SPILL)
+	// Spilling waits while a dump is running, the records stay in RAM until then
+	if(k_mutex_lock(&trace_spill_mutex, K_NO_WAIT) != 0) {
+		return;
+	}
+	for (;;) {
+		k_spinlock_key_t key = k_spin_lock(&m_lock);
+		// If records were overwritten before they could be spilled, continue from the oldest remaining one
+		uint32_t first = oldest_in_ram();
+
+		if((m_total - first) < TRACE_SPILL_BLOCK_RECORDS) {
+			k_spin_unlock(&m_lock, key);
+			break;
+		}
+		m_spill_block.checkpoint = m_state_ram;
+		for(int i = 0; i < TRACE_SPILL_BLOCK_RECORDS; i++) {
+			m_spill_block.records[i] = m_records[(first + i) % CONFIG_CAM_TL_TRACE_RECORDS];
+			state_apply(&m_state_ram, &m_spill_block.records[i]);
+		}
+		m_spilled = first + TRACE_SPILL_BLOCK_RECORDS;
+		k_spin_unlock(&m_lock, key);
+
+		uint16_t id = TRACE_NVS_ID_BLOCK_BASE + (m_blocks_written % CONFIG_CAM_TL_TRACE_FLASH_BLOCKS);
+		if(flash_handler_write_block(id, &m_spill_block, sizeof(m_spill_block)) != 0) {
+			printk("Trace spill to flash failed\n");
+			break;
+		}
+		m_blocks_written++;
+		flash_handler_write_block(TRACE_NVS_ID_META, &m_blocks_written, sizeof(m_blocks_written));
+	}
+	k_mutex_unlock(&trace_spill_mutex);
+#endif
+}
+
+static int emit_record(int (*emit)(const char *line), const trace_record_t *record)
+{
+	static char line[3 + 2 * sizeof(trace_record_t)];
+	const uint8_t *bytes = (const uint8_t *)record;
+
+	line[0] = 't';
+	line[1] = 'r';
+	for(int i = 0; i < sizeof(trace_record_t); i++) {
+		sprintf(&line[2 + i * 2], "%02x", bytes[i]);
+	}
+	return emit(line);
+}
+
+// The checkpoint takes the timestamps of the record it precedes
+static int emit_checkpoint(int (*emit)(const char *line), const trace_state_t *state, const trace_record_t *first)
+{
+	trace_record_t record = {
+		.uptime_ms = first->uptime_ms,
+		.realtime = first->realtime,
+		.type = TRACE_EVT_CHECKPOINT,
+		.len = 1 + state->settings_len,
+	};
+
+	record.data[0] = state->flags;
+	memcpy(&record.data[1], state->settings, state->settings_len);
+	return emit_record(emit, &record);
+}
+
+static int dump_records(int (*emit)(const char *line))
+{
+	trace_record_t record;
+	trace_state_t state;
+	bool checkpoint_sent = false;
+	int err;
+
+#if defined(CONFIG_CAM_TL_TRACE_FLASH_SPILL)
+	uint32_t first_block = (m_blocks_written > CONFIG_CAM_TL_TRACE_FLASH_BLOCKS) ?
+			       (m_blocks_written - CONFIG_CAM_TL_TRACE_FLASH_BLOCKS) : 0;
+
+	for(uint32_t block = first_block; block < m_blocks_written; block++) {
+		uint16_t id = TRACE_NVS_ID_BLOCK_BASE + (block % CONFIG_CAM_TL_TRACE_FLASH_BLOCKS);
+
+		// Blocks in an older format are skipped by the size check
+		if(flash_handler_read_block(id, &m_spill_block, sizeof(m_spill_block)) != sizeof(m_spill_block)) {
+			continue;
+		}
+		if(!checkpoint_sent) {
+			err = emit_checkpoint(emit, &m_spill_block.checkpoint, &m_spill_block.records[0]);
+			if (err) {
+				return err;
+			}
+			checkpoint_sent = true;
+		}
+		for(int i = 0; i < TRACE_SPILL_BLOCK_RECORDS; i++) {
+			err = emit_record(emit, &m_spill_block.records[i]);
+			if (err) {
+				return err;
+			}
+		}
+	}
+#endif
+
+	uint32_t total = m_total;
+	for(uint32_t i = oldest_in_ram(); i < total; i++) {
+		k_spinlock_key_t key = k_spin_lock(&m_lock);
+		// Records overwritten in the ring while the dump was running are lost
+		i = MAX(i, oldest_in_ram());
+		if(i >= total) {
+			k_spin_unlock(&m_lock, key);
+			break;
+		}
+		record = m_records[i % CONFIG_CAM_TL_TRACE_RECORDS];
+		state = m_state_ram;
+		k_spin_unlock(&m_lock, key);
+
+		if(!checkpoint_sent) {
+			err = emit_checkpoint(emit, &state, &record);
+			if (err) {
+				return err;
+			}
+			checkpoint_sent = true;
+		}
+		err = emit_record(emit, &record);
+		if (err) {
+			return err;
+		}
+	}
+	return 0;
+}
+
+int trace_rec_dump(int (*emit)(const char *line))
+{
+	int err;
+
+#if defined(CONFIG_CAM_TL_TRACE_FLASH_SPILL)
+	k_mutex_lock(&trace_spill_mutex, K_FOREVER);
+	err = dump_records(emit);
+	k_mutex_unlock(&trace_spill_mutex);
+#else
+	err = dump_records(emit);
+#endif
+	return err;
+}
+
+void trace_rec_clear(void)
+{
+	k_spinlock_key_t key = k_spin_lock(&m_lock);
+	m_total = 0;
+	m_spilled = 0;
+	m_state_ram = m_state_now;
+	k_spin_unlock(&m_lock, key);
+
+#if defined(CONFIG_CAM_TL_TRACE_FLASH_SPILL)
+	for(int i = 0; i < CONFIG_CAM_TL_TRACE_FLASH_BLOCKS; i++) {
+		flash_handler_delete_block(TRACE_NVS_ID_BLOCK_BASE + i);
+	}
+	m_blocks_written = 0;
+	flash_handler_write_block(TRACE_NVS_ID_META, &m_blocks_written, sizeof(m_blocks_written));
+#endif
+}
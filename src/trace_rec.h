@@ -0,0 +1,71 @@
+#ifndef __TRACE_REC_H
+#define __TRACE_REC_H
+
+#include <zephyr/kernel.h>
+
+#define TRACE_DATA_MAX 24
+
+typedef enum {
+    // Device booted, data holds the packed settings loaded at boot
+    TRACE_EVT_BOOT = 1,
+    // NUS packet received, data holds the raw command
+    TRACE_EVT_NUS,
+    // Button state changed, data holds button_state and has_changed as little endian uint32
+    TRACE_EVT_BUTTON,
+    // Wall clock set, data holds the new time as little endian uint32 followed by a trace_clock_src_t
+    TRACE_EVT_CLOCK_SET,
+    // Scheduler decided to take a picture, data holds a trace_capture_t
+    TRACE_EVT_CAPTURE,
+    // Settings changed, data holds the packed settings after the change
+    TRACE_EVT_SETTINGS,
+    // Only written by the dump, ahead of the oldest record. Data holds trace_checkpoint_flags_t followed by
+    // the packed settings, as they were before that record, so a replay can start without the boot record.
+    TRACE_EVT_CHECKPOINT,
+    // The external trigger input started a capture, no data
+    TRACE_EVT_EXT_TRIGGER,
+} trace_evt_t;
+
+typedef enum {
+    TRACE_CLOCK_SRC_BOOT,
+    TRACE_CLOCK_SRC_NUS,
+    TRACE_CLOCK_SRC_SYNC,
+} trace_clock_src_t;
+
+typedef enum {
+    TRACE_CAPTURE_TAKEN = 1,
+    // A capture was already in progress, so the scheduled picture was skipped
+    TRACE_CAPTURE_BUSY,
+    // Left to the synchronized capture command of the time master
+    TRACE_CAPTURE_SYNC,
+} trace_capture_t;
+
+typedef enum {
+    // The wall clock has been set from the app or the time master
+    TRACE_CHECKPOINT_TIME_SET = BIT(0),
+} trace_checkpoint_flags_t;
+
+typedef struct __packed {
+    uint32_t uptime_ms;
+    // Wall clock when the event occurred, before the event was handled
+    uint32_t realtime;
+    uint8_t type;
+    uint8_t len;
+    uint8_t data[TRACE_DATA_MAX];
+} trace_record_t;
+
+int trace_rec_init(void);
+
+// Safe to call from interrupt context
+void trace_rec_record(trace_evt_t type, const void *data, uint8_t len);
+
+// Spills full blocks of records to flash if enabled. Called from the main loop.
+void trace_rec_process(void);
+
+// Emits a checkpoint followed by every stored record, oldest first, as lines of "tr" followed by the record in hex.
+// May run in its own thread while records are added, spilling to flash waits until it is done.
+// Must not run while the trace is cleared.
+int trace_rec_dump(int (*emit)(const char *line));
+
+void trace_rec_clear(void);
+
+#endif
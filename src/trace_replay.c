@@ -0,0 +1,241 @@
+#include "trace_replay.h"
+#include "trace_rec.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+/* clock_settime() prototype */
+#include <zephyr/posix/time.h>
+#include <zephyr/sys/byteorder.h>
+
+// Generated at build time from CONFIG_CAM_TL_TRACE_REPLAY_FILE
+static const uint8_t m_trace_data[] = {
+#include "trace_replay_data.inc"
+};
+
+// Longest gap between two events that is stepped through second by second
+#define REPLAY_MAX_STEP_S       (7 * 24 * 3600)
+// Limit the number of divergences printed individually
+#define REPLAY_MAX_REPORTED     20
+// Kernel time is advanced by the uptime between events so that captures in progress end as recorded.
+// Longer gaps, and resets, only need to let any capture in progress complete.
+#define REPLAY_MAX_SLEEP_MS     10000
+
+static const char *const m_evt_names[] = {
+	[TRACE_EVT_BOOT] = "boot",
+	[TRACE_EVT_NUS] = "nus",
+	[TRACE_EVT_BUTTON] = "button",
+	[TRACE_EVT_CLOCK_SET] = "clock set",
+	[TRACE_EVT_CAPTURE] = "capture",
+	[TRACE_EVT_SETTINGS] = "settings",
+	[TRACE_EVT_CHECKPOINT] = "checkpoint",
+	[TRACE_EVT_EXT_TRIGGER] = "ext trigger",
+};
+
+static const char *const m_capture_names[] = {
+	[TRACE_CAPTURE_TAKEN] = "taken",
+	[TRACE_CAPTURE_BUSY] = "busy",
+	[TRACE_CAPTURE_SYNC] = "sync",
+};
+
+typedef struct {
+	uint32_t count;
+	uint64_t total_ns;
+	uint64_t max_ns;
+} evt_cost_t;
+
+static evt_cost_t m_cost[ARRAY_SIZE(m_evt_names)];
+static uint32_t m_divergences;
+
+#if defined(CAM_TL_TRACE_REPLAY_HOST_CLOCK)
+// Implemented in the native simulator runner. Simulated time does not advance while code runs,
+// so handling cost is measured on the host clock instead.
+uint64_t trace_host_time_ns(void);
+
+static uint64_t cost_timestamp(void)
+{
+	return trace_host_time_ns();
+}
+
+static uint64_t cost_ns(uint64_t start)
+{
+	return trace_host_time_ns() - start;
+}
+#else
+static uint64_t cost_timestamp(void)
+{
+	return k_cycle_get_32();
+}
+
+static uint64_t cost_ns(uint64_t start)
+{
+	return k_cyc_to_ns_floor64(k_cycle_get_32() - (uint32_t)start);
+}
+#endif
+
+static void set_clock(time_t t)
+{
+	struct timespec ts = {.tv_sec = t, .tv_nsec = 0};
+
+	clock_settime(CLOCK_REALTIME, &ts);
+}
+
+static void report_divergence(const char *what, uint32_t realtime)
+{
+	m_divergences++;
+	if(m_divergences <= REPLAY_MAX_REPORTED) {
+		printk("Divergence at %u: %s\n", realtime, what);
+	}
+}
+
+static const char *capture_name(uint8_t decision)
+{
+	if(decision >= ARRAY_SIZE(m_capture_names) || m_capture_names[decision] == NULL) {
+		return "unknown";
+	}
+	return m_capture_names[decision];
+}
+
+// Returns true if the replayed decision for a due slot matches the recorded one
+static bool compare_capture(const trace_replay_hooks_t *hooks, uint8_t recorded, time_t t)
+{
+	static char what[64];
+
+	// Whether the node was synchronized is not recorded, so only the schedule can be checked
+	if(recorded == TRACE_CAPTURE_SYNC) {
+		return true;
+	}
+
+	trace_capture_t replayed = hooks->capture(t);
+	if(replayed == recorded) {
+		return true;
+	}
+	snprintf(what, sizeof(what), "capture decision differs, recorded %s, replayed %s", capture_name(recorded),
+		 capture_name(replayed));
+	report_divergence(what, t);
+	return false;
+}
+
+int trace_replay_run(const trace_replay_hooks_t *hooks)
+{
+	uint32_t num_records = sizeof(m_trace_data) / sizeof(trace_record_t);
+	uint32_t captures_recorded = 0;
+	uint32_t captures_matched = 0;
+	time_t sim_time = 0;
+	bool have_time = false;
+	uint32_t prev_uptime_ms = 0;
+	uint8_t settings[TRACE_DATA_MAX];
+	trace_record_t rec;
+
+	printk("Replaying %u trace records\n", num_records);
+	if((sizeof(m_trace_data) % sizeof(trace_record_t)) != 0) {
+		printk("Trace has %u trailing bytes, ignored\n", (uint32_t)(sizeof(m_trace_data) % sizeof(trace_record_t)));
+	}
+
+	m_divergences = 0;
+	memset(m_cost, 0, sizeof(m_cost));
+
+	for(uint32_t i = 0; i < num_records; i++) {
+		memcpy(&rec, &m_trace_data[i * sizeof(trace_record_t)], sizeof(rec));
+		time_t rec_time = sys_le32_to_cpu(rec.realtime);
+
+		if(i == 0 && rec.type != TRACE_EVT_BOOT && rec.type != TRACE_EVT_CHECKPOINT) {
+			printk("Trace does not start at boot or a checkpoint, replay starts from the default settings\n");
+		}
+		if(rec.type >= ARRAY_SIZE(m_evt_names) || m_evt_names[rec.type] == NULL) {
+			printk("Unknown record type %u, skipped\n", rec.type);
+			continue;
+		}
+
+		// Step the scheduler through the seconds since the previous event. Any capture it wants here
+		// should have been recorded, since records are in time order.
+		if(have_time && rec_time > sim_time + 1) {
+			time_t end = MIN(rec_time, sim_time + REPLAY_MAX_STEP_S);
+
+			for(time_t t = sim_time + 1; t < end; t++) {
+				if(hooks->scheduler_decide(t)) {
+					report_divergence("scheduled capture missing from trace", t);
+				}
+			}
+		}
+
+		uint32_t uptime_ms = sys_le32_to_cpu(rec.uptime_ms);
+		if(have_time) {
+			uint32_t sleep_ms = (uptime_ms >= prev_uptime_ms) ? (uptime_ms - prev_uptime_ms) : REPLAY_MAX_SLEEP_MS;
+
+			k_sleep(K_MSEC(MIN(sleep_ms, REPLAY_MAX_SLEEP_MS)));
+		}
+		prev_uptime_ms = uptime_ms;
+
+		// Clock set records are compared against the clock instead of overwriting it
+		if(rec.type != TRACE_EVT_CLOCK_SET) {
+			set_clock(rec_time);
+		}
+
+		uint64_t start = cost_timestamp();
+		switch(rec.type) {
+			case TRACE_EVT_BOOT:
+				hooks->boot(rec.data, rec.len);
+				break;
+			case TRACE_EVT_CHECKPOINT:
+				if(rec.len >= 1) {
+					hooks->checkpoint(&rec.data[1], rec.len - 1, (rec.data[0] & TRACE_CHECKPOINT_TIME_SET) != 0);
+				}
+				break;
+			case TRACE_EVT_NUS:
+				hooks->nus_packet(rec.data, rec.len);
+				break;
+			case TRACE_EVT_BUTTON:
+				hooks->button(sys_get_le32(&rec.data[0]), sys_get_le32(&rec.data[4]));
+				break;
+			case TRACE_EVT_CLOCK_SET: {
+				time_t new_time = sys_get_le32(&rec.data[0]);
+				trace_clock_src_t source = rec.data[4];
+
+				// Clock sets from NUS commands have already been replayed with the command itself
+				if(source == TRACE_CLOCK_SRC_NUS && time(NULL) != new_time) {
+					report_divergence("clock set over NUS differs", rec_time);
+				}
+				hooks->set_time(new_time, source != TRACE_CLOCK_SRC_BOOT);
+				break;
+			}
+			case TRACE_EVT_CAPTURE:
+				captures_recorded++;
+				if(!hooks->scheduler_decide(rec_time)) {
+					report_divergence("recorded capture not scheduled in replay", rec_time);
+				} else if(compare_capture(hooks, rec.data[0], rec_time)) {
+					captures_matched++;
+				}
+				break;
+			case TRACE_EVT_EXT_TRIGGER:
+				hooks->ext_trigger();
+				break;
+			case TRACE_EVT_SETTINGS:
+				if(hooks->get_settings(settings) != rec.len || memcmp(settings, rec.data, rec.len) != 0) {
+					report_divergence("settings differ", rec_time);
+					hooks->set_settings(rec.data, rec.len);
+				}
+				break;
+		}
+		uint64_t elapsed_ns = cost_ns(start);
+		hooks->poll();
+
+		m_cost[rec.type].count++;
+		m_cost[rec.type].total_ns += elapsed_ns;
+		m_cost[rec.type].max_ns = MAX(m_cost[rec.type].max_ns, elapsed_ns);
+
+		sim_time = time(NULL);
+		have_time = true;
+	}
+
+	printk("Per event handling cost:\n");
+	for(int type = 0; type < ARRAY_SIZE(m_cost); type++) {
+		if(m_cost[type].count == 0) continue;
+		printk("  %-10s %6u events, avg %llu ns, max %llu ns\n", m_evt_names[type], m_cost[type].count,
+		       m_cost[type].total_ns / m_cost[type].count, m_cost[type].max_ns);
+	}
+	printk("Captures: %u recorded, %u matched\n", captures_recorded, captures_matched);
+	printk("Replay %s with %u divergences\n", m_divergences ? "FAILED" : "PASSED", m_divergences);
+
+	return m_divergences;
+}
@@ -0,0 +1,37 @@
+#ifndef __TRACE_REPLAY_H
+#define __TRACE_REPLAY_H
+
+#include <zephyr/kernel.h>
+#include <time.h>
+
+#include "trace_rec.h"
+
+// Entry points into the application, called with the data of the recorded events
+typedef struct {
+    // Resets the application state to what it was after boot with the given packed settings
+    void (*boot)(const uint8_t *settings, uint8_t len);
+    // Restores the state saved in a checkpoint, for traces that do not start at boot
+    void (*checkpoint)(const uint8_t *settings, uint8_t len, bool time_set);
+    // Applies packed settings, used to resynchronize after a divergence
+    void (*set_settings)(const uint8_t *settings, uint8_t len);
+    void (*nus_packet)(const uint8_t *data, uint8_t len);
+    void (*button)(uint32_t button_state, uint32_t has_changed);
+    // Sets the wall clock, and marks it as set from the app if set_from_app is true
+    void (*set_time)(time_t t, bool set_from_app);
+    // Returns true if the scheduler would take a picture at the given time. Must not have side effects.
+    bool (*scheduler_decide)(time_t t);
+    // Runs a due scheduled capture through the camera arbitration, and returns the decision
+    trace_capture_t (*capture)(time_t t);
+    // Starts the camera activity of a capture from the external trigger input
+    void (*ext_trigger)(void);
+    // Handles requests the main loop would pick up after an event, such as manual captures
+    void (*poll)(void);
+    // Packs the current settings into buf, returns the length
+    uint8_t (*get_settings)(uint8_t *buf);
+} trace_replay_hooks_t;
+
+// Replays the trace built into the image, and prints the handling cost and capture decision comparison.
+// Returns the number of divergences from the recorded trace.
+int trace_replay_run(const trace_replay_hooks_t *hooks);
+
+#endif
@@ -0,0 +1,78 @@
+#!/usr/bin/env bash
+#
+# Copyright (c) 2018 Nordic Semiconductor
+#
+# SPDX-License-Identifier: LicenseRef-Nordic-5-Clause
+#
+# Runs one synchronized capture master and two followers on the simulated nrf52_bsim board, and fails
+# if the followers fire more than MAX_SKEW_US apart. Needs west and BSIM_OUT_PATH set up for babblesim.
+#
+# Usage: tests/bsim/sync_skew.sh [build dir]
+
+set -u
+
+APP_DIR=$(cd "$(dirname "$0")/../.." && pwd)
+BUILD_DIR=$(realpath -m "${1:-${APP_DIR}/build_bsim}")
+SIM_ID=cam_sync_skew
+SIM_LENGTH_US=60e6
+FIRE_INTERVAL_S=5
+MAX_SKEW_US=1000
+MIN_CAPTURES=5
+
+if [ -z "${BSIM_OUT_PATH:-}" ]; then
+	echo "BSIM_OUT_PATH is not set"
+	exit 1
+fi
+
+build()
+{
+	west build -b nrf52_bsim -s "${APP_DIR}" -d "${BUILD_DIR}/$1" -- -DOVERLAY_CONFIG=overlay-sync.conf "${@:2}" \
+		> "${BUILD_DIR}/$1.build.log" 2>&1 || { echo "Build of $1 failed, see ${BUILD_DIR}/$1.build.log"; exit 1; }
+}
+
+mkdir -p "${BUILD_DIR}"
+build master -DCONFIG_CAM_TL_SYNC_ROLE_MASTER=y -DCONFIG_CAM_TL_SYNC_AUTO_FIRE_INTERVAL_S=${FIRE_INTERVAL_S}
+build follower -DCONFIG_CAM_TL_SYNC_ROLE_FOLLOWER=y
+
+cd "${BSIM_OUT_PATH}/bin"
+./bs_2G4_phy_v1 -s=${SIM_ID} -D=3 -sim_length=${SIM_LENGTH_US} > "${BUILD_DIR}/phy.log" 2>&1 &
+"${BUILD_DIR}/master/zephyr/zephyr.exe" -s=${SIM_ID} -d=0 > "${BUILD_DIR}/d0.log" 2>&1 &
+"${BUILD_DIR}/follower/zephyr/zephyr.exe" -s=${SIM_ID} -d=1 > "${BUILD_DIR}/d1.log" 2>&1 &
+"${BUILD_DIR}/follower/zephyr/zephyr.exe" -s=${SIM_ID} -d=2 > "${BUILD_DIR}/d2.log" 2>&1 &
+wait
+
+# All devices share the simulated time base, so the capture times can be compared directly.
+# Each capture of follower 1 is paired with the nearest one of follower 2 within half a fire interval.
+captures()
+{
+	sed -n 's/.*Sync capture at \([0-9]\+\) us.*/\1/p' "$1"
+}
+
+awk -v max_skew=${MAX_SKEW_US} -v window=$((FIRE_INTERVAL_S * 500000)) -v min_captures=${MIN_CAPTURES} '
+	NR == FNR { a[na++] = $1; next }
+	{ b[nb++] = $1 }
+	END {
+		failed = 0
+		pairs = 0
+		for(i = 0; i < na; i++) {
+			best = -1
+			for(j = 0; j < nb; j++) {
+				d = a[i] - b[j]
+				if(d < 0) d = -d
+				if(d < window && (best < 0 || d < best)) best = d
+			}
+			if(best < 0) {
+				printf("Capture at %d us on follower 1 has no match on follower 2\n", a[i])
+				continue
+			}
+			pairs++
+			printf("Capture at %d us, skew %d us\n", a[i], best)
+			if(best > max_skew) failed = 1
+		}
+		if(pairs < min_captures) {
+			printf("Only %d matched captures, at least %d expected\n", pairs, min_captures)
+			failed = 1
+		}
+		print(failed ? "Sync skew test FAILED" : "Sync skew test PASSED")
+		exit failed
+	}' <(captures "${BUILD_DIR}/d1.log") <(captures "${BUILD_DIR}/d2.log")